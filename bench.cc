@@ -0,0 +1,558 @@
+/*
+ * bench.cc - Copyright (c) 2020 - Olivier Poncet
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <climits>
+#include <csignal>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <array>
+#include <string>
+#include <memory>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <iostream>
+#include <iomanip>
+#include <stdexcept>
+#include "chat.h"
+
+// ---------------------------------------------------------------------------
+// BenchConfig
+// ---------------------------------------------------------------------------
+
+namespace {
+
+struct BenchConfig
+{
+    uint32_t addr        = INADDR_LOOPBACK;
+    uint16_t port        = 1976;
+    size_t   connections = 1000;
+    size_t   senders     = 10;
+    size_t   rate        = 100;
+    size_t   size        = 64;
+    double   duration    = 10.0;
+    double   drain       = 2.0;
+    size_t   storm       = 0;
+    double   max_p99     = 0.0;
+};
+
+constexpr size_t storm_in_flight = 256;
+
+void raise_descriptor_limit()
+{
+    /* thousands of sockets need more than the usual 1024 descriptors */
+    rlimit limit = {};
+    if((::getrlimit(RLIMIT_NOFILE, &limit) == 0) && (limit.rlim_cur < limit.rlim_max)) {
+        limit.rlim_cur = limit.rlim_max;
+        static_cast<void>(::setrlimit(RLIMIT_NOFILE, &limit));
+    }
+}
+
+}
+
+// ---------------------------------------------------------------------------
+// LoadGenerator
+// ---------------------------------------------------------------------------
+
+namespace {
+
+class LoadGenerator final
+    : protected EventListener
+{
+public:
+    LoadGenerator(const BenchConfig& config);
+
+    void connect();
+
+    void run();
+
+    void storm();
+
+    void report(std::ostream& stream) const;
+
+    void reportStorm(std::ostream& stream) const;
+
+    bool check(std::ostream& stream) const;
+
+protected:
+    virtual void onReadable(const int fd) override;
+
+    virtual void onWritable(const int fd) override;
+
+private:
+    struct Client
+    {
+        Client(const size_t max_line)
+            : socket()
+            , inbound(max_line)
+            , outbound()
+            , started(Metrics::now())
+            , ready(false)
+            , done(false)
+        {
+        }
+
+        Socket      socket;
+        LineFramer  inbound;
+        std::string outbound;
+        uint64_t    started;
+        bool        ready;
+        bool        done;
+    };
+
+    void open();
+
+    void retire(const int fd);
+
+    void send(Client& client);
+
+    bool flush(Client& client);
+
+    void handleLine(Client& client, const char* line, const size_t length);
+
+private:
+    const BenchConfig                    _config;
+    const unsigned long                  _run;
+    std::unique_ptr<EventLoop>           _event_loop;
+    std::vector<std::unique_ptr<Client>> _clients;
+    std::vector<Client*>                 _senders;
+    std::unique_ptr<Histogram>           _latency;
+    std::string                          _payload;
+    size_t                               _opened;
+    size_t                               _connecting;
+    uint64_t                             _sequence;
+    uint64_t                             _sent;
+    uint64_t                             _skipped;
+    uint64_t                             _delivered;
+    uint64_t                             _foreign;
+    uint64_t                             _bytes_in;
+    uint64_t                             _accepted;
+    uint64_t                             _rejected;
+    uint64_t                             _failed;
+    double                               _elapsed;
+};
+
+LoadGenerator::LoadGenerator(const BenchConfig& config)
+    : EventListener()
+    , _config(config)
+    , _run(::getpid())
+    , _event_loop(EventLoop::create("epoll", *this))
+    , _clients()
+    , _senders()
+    , _latency(new Histogram())
+    , _payload()
+    , _opened(0)
+    , _connecting(0)
+    , _sequence(0)
+    , _sent(0)
+    , _skipped(0)
+    , _delivered(0)
+    , _foreign(0)
+    , _bytes_in(0)
+    , _accepted(0)
+    , _rejected(0)
+    , _failed(0)
+    , _elapsed(0.0)
+{
+}
+
+void LoadGenerator::connect()
+{
+    raise_descriptor_limit();
+    /*
+     * connections are opened asynchronously with a bounded number in flight, a handshake
+     * dropped by a full accept queue is retried by the kernel without stalling the others,
+     * and a connection only counts once the server has answered its probe
+     */
+    const uint64_t timeout = Metrics::now() + 60000000000UL;
+    while((_opened < _config.connections) || (_connecting != 0)) {
+        while((_opened < _config.connections) && (_connecting < 64)) {
+            open();
+        }
+        _event_loop->wait(10);
+        if(Metrics::now() > timeout) {
+            throw std::runtime_error("the connections could not be established in time");
+        }
+    }
+    /* let the server register everybody and flush the replayed backlog before measuring */
+    const uint64_t settle = Metrics::now() + 500000000UL;
+    while(Metrics::now() < settle) {
+        _event_loop->wait(10);
+    }
+    _delivered = _foreign = _bytes_in = 0;
+    _latency.reset(new Histogram());
+}
+
+void LoadGenerator::run()
+{
+    const uint64_t start    = Metrics::now();
+    const uint64_t stop     = start + static_cast<uint64_t>(_config.duration * 1e9);
+    const uint64_t deadline = stop  + static_cast<uint64_t>(_config.drain * 1e9);
+    uint64_t       now      = start;
+
+    /* messages are paced against the clock, a late tick sends the backlog of due messages */
+    while(now < stop) {
+        _event_loop->wait(1);
+        now = Metrics::now();
+        const uint64_t due = static_cast<uint64_t>((now - start) * 1e-9 * _config.rate);
+        while(_sequence < due) {
+            send(*_senders[_sequence % _senders.size()]);
+        }
+    }
+    const uint64_t expected = _sent * (_config.connections - 1);
+    while((now < deadline) && (_delivered < expected)) {
+        for(Client* sender : _senders) {
+            static_cast<void>(flush(*sender));
+        }
+        _event_loop->wait(10);
+        now = Metrics::now();
+    }
+    _elapsed = (now - start) * 1e-9;
+}
+
+void LoadGenerator::storm()
+{
+    /*
+     * connections are opened as fast as the server lets them in, each one is done once
+     * its probe is answered or refused, and is then reset so that no port lingers
+     */
+    raise_descriptor_limit();
+    const uint64_t start   = Metrics::now();
+    const uint64_t timeout = start + 120000000000UL;
+    while((_opened < _config.storm) || (_connecting != 0)) {
+        while((_opened < _config.storm) && (_connecting < storm_in_flight)) {
+            open();
+        }
+        _event_loop->wait(1);
+        if(Metrics::now() > timeout) {
+            throw std::runtime_error("the storm could not be completed in time");
+        }
+    }
+    _elapsed = (Metrics::now() - start) * 1e-9;
+}
+
+void LoadGenerator::report(std::ostream& stream) const
+{
+    const uint64_t expected   = _sent * (_config.connections - 1);
+    const double   sent_rate  = _sent / _config.duration;
+    const double   deliveries = _delivered / _elapsed;
+    const double   megabytes  = (_bytes_in / _elapsed) / 1e6;
+    const double   ratio      = (expected != 0 ? (100.0 * _delivered) / expected : 0.0);
+
+    stream << std::fixed << std::setprecision(1)
+           << "connections : " << _config.connections << " (" << _senders.size() << " senders)" << std::endl
+           << "messages    : " << _sent << " sent, " << _skipped << " skipped, " << _config.size << " bytes each" << std::endl
+           << "deliveries  : " << _delivered << " of " << expected << " (" << ratio << "%)" << std::endl
+           << "throughput  : " << sent_rate << " msg/s in, " << deliveries << " msg/s out, " << megabytes << " MB/s out" << std::endl
+           << "latency     : p50 " << (_latency->percentile(0.50) / 1e3) << " us"
+           << ", p99 " << (_latency->percentile(0.99) / 1e3) << " us"
+           << ", p999 " << (_latency->percentile(0.999) / 1e3) << " us"
+           << ", max " << (_latency->percentile(1.0) / 1e3) << " us" << std::endl;
+    /* one line of key=value pairs, to be recorded and compared against a baseline */
+    stream << "bench"
+           << " connections=" << _config.connections
+           << " senders=" << _senders.size()
+           << " rate=" << _config.rate
+           << " size=" << _config.size
+           << " sent=" << _sent
+           << " skipped=" << _skipped
+           << " delivered=" << _delivered
+           << " expected=" << expected
+           << " deliveries_per_sec=" << deliveries
+           << " p50_us=" << (_latency->percentile(0.50) / 1e3)
+           << " p99_us=" << (_latency->percentile(0.99) / 1e3)
+           << " p999_us=" << (_latency->percentile(0.999) / 1e3)
+           << std::endl;
+}
+
+bool LoadGenerator::check(std::ostream& stream) const
+{
+    /* every message must have been delivered, the 99th percentile within the bound */
+    const uint64_t expected = _sent * (_config.connections - 1);
+    const double   p99      = (_latency->percentile(0.99) / 1e3);
+    const bool     passed   = ((_sent != 0) && (_delivered >= expected) && (p99 < _config.max_p99));
+
+    stream << std::fixed << std::setprecision(1)
+           << "check       : p99 " << p99 << " us (bound " << _config.max_p99 << " us), "
+           << _delivered << " of " << expected << " delivered, "
+           << (passed ? "passed" : "FAILED") << std::endl;
+    return passed;
+}
+
+void LoadGenerator::reportStorm(std::ostream& stream) const
+{
+    const double rate = (_accepted + _rejected) / _elapsed;
+
+    stream << std::fixed << std::setprecision(1)
+           << "storm       : " << _config.storm << " connections, " << storm_in_flight << " in flight" << std::endl
+           << "admission   : " << _accepted << " accepted, " << _rejected << " rejected, " << _failed << " failed" << std::endl
+           << "throughput  : " << rate << " connections/s in " << _elapsed << " s" << std::endl
+           << "latency     : p50 " << (_latency->percentile(0.50) / 1e3) << " us"
+           << ", p99 " << (_latency->percentile(0.99) / 1e3) << " us"
+           << ", p999 " << (_latency->percentile(0.999) / 1e3) << " us"
+           << ", max " << (_latency->percentile(1.0) / 1e3) << " us" << std::endl;
+    stream << "storm"
+           << " connections=" << _config.storm
+           << " accepted=" << _accepted
+           << " rejected=" << _rejected
+           << " failed=" << _failed
+           << " connections_per_sec=" << rate
+           << " p50_us=" << (_latency->percentile(0.50) / 1e3)
+           << " p99_us=" << (_latency->percentile(0.99) / 1e3)
+           << " p999_us=" << (_latency->percentile(0.999) / 1e3)
+           << std::endl;
+}
+
+void LoadGenerator::onReadable(const int fd)
+{
+    Client& client(*_clients[fd]);
+    LineFramer& inbound(client.inbound);
+    while(!client.done) {
+        inbound.reserve(65536);
+        const ssize_t bytes_read = ::recv(fd, inbound.tail(), inbound.room(), 0);
+        if(bytes_read <= 0) {
+            if((bytes_read < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))) {
+                return;
+            }
+            if(_config.storm == 0) {
+                throw std::runtime_error("the server has closed a connection");
+            }
+            ++_rejected;
+            break;
+        }
+        _bytes_in += bytes_read;
+        inbound.commit(bytes_read);
+        const char* line   = nullptr;
+        size_t      length = 0;
+        while(!client.done && inbound.next(line, length)) {
+            handleLine(client, line, length);
+        }
+    }
+    retire(fd);
+}
+
+void LoadGenerator::onWritable(const int fd)
+{
+    /* the first writability tells that the handshake is over, the probe is answered by the server */
+    Client&   client(*_clients[fd]);
+    int       error = 0;
+    socklen_t size  = sizeof(error);
+    if((::getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size) != 0) || (error != 0)) {
+        if(_config.storm == 0) {
+            throw std::runtime_error("connect() has failed");
+        }
+        ++_failed;
+        retire(fd);
+        return;
+    }
+    client.outbound = "/leave #bench\n";
+    static_cast<void>(flush(client));
+    _event_loop->modify(fd, EventLoop::EV_READ);
+}
+
+void LoadGenerator::open()
+{
+    std::unique_ptr<Client> client(new Client(65536));
+    client->socket.create();
+    client->socket.set_nonblock(true);
+    const int nodelay = 1;
+    static_cast<void>(::setsockopt(client->socket.fd(), IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)));
+    const EndPoint endpoint(_config.addr, _config.port);
+    if((::connect(client->socket.fd(), endpoint.data(), endpoint.size()) < 0) && (errno != EINPROGRESS)) {
+        throw std::runtime_error("connect() has failed");
+    }
+    const int fd = client->socket.fd();
+    if(static_cast<size_t>(fd) >= _clients.size()) {
+        _clients.resize(fd + 1);
+    }
+    _event_loop->add(fd, EventLoop::EV_WRITE);
+    if((_config.storm == 0) && (_senders.size() < std::max<size_t>(_config.senders, 1))) {
+        _senders.push_back(client.get());
+    }
+    _clients[fd] = std::move(client);
+    ++_opened;
+    ++_connecting;
+}
+
+void LoadGenerator::retire(const int fd)
+{
+    /* a reset rather than a close, the storm would otherwise run out of ephemeral ports */
+    const linger reset = {1, 0};
+    static_cast<void>(::setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset)));
+    if(!_clients[fd]->ready) {
+        --_connecting;
+    }
+    _event_loop->remove(fd);
+    _clients[fd].reset();
+}
+
+void LoadGenerator::send(Client& client)
+{
+    /* a sender whose socket is still full skips its turn rather than queueing without bound */
+    ++_sequence;
+    if(!flush(client)) {
+        ++_skipped;
+        return;
+    }
+    char header[64];
+    const int rc = ::snprintf(header, sizeof(header), "B %lu %llu %llu ", _run, static_cast<unsigned long long>(_sequence), static_cast<unsigned long long>(Metrics::now()));
+    _payload.assign(header, rc);
+    if(_payload.size() + 1 < _config.size) {
+        _payload.append(_config.size - _payload.size() - 1, 'x');
+    }
+    _payload.push_back('\n');
+    const size_t sent = client.socket.send(_payload);
+    if(sent < _payload.size()) {
+        client.outbound.assign(_payload, sent, std::string::npos);
+    }
+    ++_sent;
+}
+
+bool LoadGenerator::flush(Client& client)
+{
+    if(!client.outbound.empty()) {
+        const size_t sent = client.socket.send(client.outbound);
+        client.outbound.erase(0, sent);
+    }
+    return client.outbound.empty();
+}
+
+void LoadGenerator::handleLine(Client& client, const char* line, const size_t length)
+{
+    if(!client.ready && (length >= 2) && (line[0] == '*') && (line[1] == ' ')) {
+        client.ready = true;
+        --_connecting;
+        if(_config.storm != 0) {
+            const bool refused = ((length >= 11) && (::strncmp(line, "* too many ", 11) == 0));
+            _latency->record(Metrics::now() - client.started);
+            ++(refused ? _rejected : _accepted);
+            client.done = true;
+        }
+        return;
+    }
+    /* heartbeats are answered at once, so that the server can be measured with them enabled */
+    if((length > 7) && (::strncmp(line, "* ping ", 7) == 0)) {
+        client.outbound.append("/pong ").append(line + 7, length - 7).push_back('\n');
+        static_cast<void>(flush(client));
+        return;
+    }
+    /* only the lines of this run carry a meaningful timestamp, the replayed backlog is ignored */
+    unsigned long      run      = 0;
+    unsigned long long sequence = 0;
+    unsigned long long stamp    = 0;
+    if((length < 2) || (line[0] != 'B') || (::sscanf(line, "B %lu %llu %llu", &run, &sequence, &stamp) != 3) || (run != _run)) {
+        ++_foreign;
+        return;
+    }
+    _latency->record(Metrics::now() - stamp);
+    ++_delivered;
+}
+
+}
+
+// ---------------------------------------------------------------------------
+// main
+// ---------------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+    try {
+        BenchConfig config;
+        for(int argi = 1; argi < argc; ++argi) {
+            const std::string arg(argv[argi]);
+            if(arg.compare(0, 7, "--addr=") == 0) {
+                in_addr addr = {};
+                if(::inet_pton(AF_INET, arg.substr(7).c_str(), &addr) != 1) {
+                    throw std::runtime_error("invalid argument <" + arg + ">");
+                }
+                config.addr = ntohl(addr.s_addr);
+            }
+            else if(arg.compare(0, 7, "--port=") == 0) {
+                config.port = std::stoul(arg.substr(7));
+            }
+            else if(arg.compare(0, 14, "--connections=") == 0) {
+                config.connections = std::max<size_t>(std::stoul(arg.substr(14)), 2);
+            }
+            else if(arg.compare(0, 10, "--senders=") == 0) {
+                config.senders = std::stoul(arg.substr(10));
+            }
+            else if(arg.compare(0, 7, "--rate=") == 0) {
+                config.rate = std::stoul(arg.substr(7));
+            }
+            else if(arg.compare(0, 7, "--size=") == 0) {
+                config.size = std::stoul(arg.substr(7));
+            }
+            else if(arg.compare(0, 11, "--duration=") == 0) {
+                config.duration = std::stod(arg.substr(11));
+            }
+            else if(arg.compare(0, 8, "--storm=") == 0) {
+                config.storm = std::stoul(arg.substr(8));
+            }
+            else if(arg.compare(0, 10, "--max-p99=") == 0) {
+                config.max_p99 = std::stod(arg.substr(10));
+            }
+            else {
+                throw std::runtime_error("invalid argument <" + arg + ">");
+            }
+        }
+        LoadGenerator generator(config);
+        if(config.storm != 0) {
+            generator.storm();
+            generator.reportStorm(std::cout);
+        }
+        else {
+            generator.connect();
+            generator.run();
+            generator.report(std::cout);
+            if((config.max_p99 > 0) && !generator.check(std::cout)) {
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    catch(const std::exception& e) {
+        const char* what(e.what());
+        std::cerr << "error: " << what << std::endl;
+        return EXIT_FAILURE;
+    }
+    catch(...) {
+        const char* what("unhandled exception");
+        std::cerr << "error: " << what << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// ---------------------------------------------------------------------------
+// End-Of-File
+// ---------------------------------------------------------------------------
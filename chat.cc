@@ -18,19 +18,44 @@
 #include <cstdlib>
 #include <cstring>
 #include <cstdint>
+#include <climits>
+#include <cmath>
 #include <csignal>
 #include <unistd.h>
+#include <fcntl.h>
 #include <poll.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#ifdef HAVE_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 #include <array>
 #include <string>
 #include <memory>
+#include <deque>
 #include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
 #include <thread>
+#include <chrono>
 #include <iostream>
+#include <sstream>
 #include <stdexcept>
 #include "chat.h"
 
@@ -196,6 +221,7 @@ void SignalListener::onSigUsr2()
 SignalManager::SignalManager(SignalListener& listener)
     : _listener(listener)
     , _sigmask()
+    , _sigfd(-1)
     , _sighgup(SIGHUP)
     , _sigintr(SIGINT)
     , _sigterm(SIGTERM)
@@ -235,13 +261,25 @@ SignalManager::SignalManager(SignalListener& listener)
     install(_sigalrm, _sigmask);
     install(_sigusr1, _sigmask);
     install(_sigusr2, _sigmask);
+
+    _sigfd = ::signalfd(-1, &(*_sigmask), SFD_NONBLOCK | SFD_CLOEXEC);
+    if(_sigfd < 0) {
+        throw std::runtime_error("signalfd() has failed");
+    }
+}
+
+SignalManager::~SignalManager()
+{
+    if(_sigfd >= 0) {
+        _sigfd = (::close(_sigfd), -1);
+    }
 }
 
 bool SignalManager::timedwait(const unsigned long timeout)
 {
     struct timespec ts;
     ts.tv_sec  = (timeout / 1000UL) * 1UL;
-    ts.tv_nsec = (timeout % 1000UL) * 1000UL;
+    ts.tv_nsec = (timeout % 1000UL) * 1000000UL;
 
     const int rc = ::sigtimedwait(&(*_sigmask), nullptr, &ts);
     if(rc < 0) {
@@ -253,7 +291,38 @@ bool SignalManager::timedwait(const unsigned long timeout)
         }
         throw std::runtime_error("sigtimedwait() has failed");
     }
-    switch(rc) {
+    notify(rc);
+    return true;
+}
+
+bool SignalManager::dispatch()
+{
+    /* the signalfd is non-blocking, drain every pending signal */
+    bool dispatched = false;
+    signalfd_siginfo siginfo;
+    while(true) {
+        const ssize_t rc = ::read(_sigfd, &siginfo, sizeof(siginfo));
+        if(rc < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                break;
+            }
+            throw std::runtime_error("read() has failed");
+        }
+        if(rc != sizeof(siginfo)) {
+            break;
+        }
+        notify(siginfo.ssi_signo);
+        dispatched = true;
+    }
+    return dispatched;
+}
+
+void SignalManager::notify(const int signum)
+{
+    switch(signum) {
         case SIGHUP:
             _listener.onSigHgup();
             break;
@@ -281,7 +350,6 @@ bool SignalManager::timedwait(const unsigned long timeout)
         default:
             break;
     }
-    return true;
 }
 
 // ---------------------------------------------------------------------------
@@ -359,21 +427,62 @@ void Socket::listen(const int backlog)
 
 int Socket::accept()
 {
-    SockAddrIn addr = {};
-    socklen_t  size = sizeof(addr);
-    const int rc = ::accept(_fd, reinterpret_cast<sockaddr*>(&addr), &size);
-    if(rc < 0) {
+    EndPoint peer;
+    return accept(peer);
+}
+
+int Socket::accept(EndPoint& peer)
+{
+    /*
+     * accepted sockets are born non-blocking, an aborted handshake is skipped, and
+     * running out of descriptors is reported as errno, left for the caller to handle
+     */
+    while(true) {
+        socklen_t size = peer.size();
+        const int rc   = ::accept4(_fd, peer.data(), &size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(rc >= 0) {
+            return rc;
+        }
+        if((errno == EINTR) || (errno == ECONNABORTED)) {
+            continue;
+        }
+        if((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EMFILE) || (errno == ENFILE)) {
+            return -1;
+        }
         throw std::runtime_error("accept() has failed");
     }
-    return rc;
 }
 
-void Socket::send(const std::string& string)
+void Socket::set_nonblock(const bool value) const
 {
-    const ssize_t rc = ::send(_fd, string.data(), string.size(), 0);
+    const int flags = ::fcntl(_fd, F_GETFL, 0);
+    if(flags < 0) {
+        throw std::runtime_error("fcntl() has failed");
+    }
+    const int rc = ::fcntl(_fd, F_SETFL, (value ? flags | O_NONBLOCK : flags & ~O_NONBLOCK));
     if(rc < 0) {
-        std::cerr << "Error sending to client " << _fd << std::endl;
-        close();
+        throw std::runtime_error("fcntl() has failed");
+    }
+}
+
+size_t Socket::send(const std::string& string)
+{
+    return send(string.data(), string.size());
+}
+
+size_t Socket::send(const char* data, const size_t size)
+{
+    while(true) {
+        const ssize_t rc = ::send(_fd, data, size, MSG_NOSIGNAL);
+        if(rc >= 0) {
+            return rc;
+        }
+        if(errno == EINTR) {
+            continue;
+        }
+        if((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+            return 0;
+        }
         throw std::runtime_error("send() has failed");
     }
 }
@@ -394,6 +503,44 @@ void Socket::recv(std::string& string)
     }
 }
 
+size_t Socket::send(const iovec* iov, const size_t count)
+{
+    msghdr msg = {};
+    msg.msg_iov    = const_cast<iovec*>(iov);
+    msg.msg_iovlen = count;
+
+    while(true) {
+        const ssize_t rc = ::sendmsg(_fd, &msg, MSG_NOSIGNAL);
+        if(rc >= 0) {
+            return rc;
+        }
+        if(errno == EINTR) {
+            continue;
+        }
+        if((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        throw std::runtime_error("sendmsg() has failed");
+    }
+}
+
+size_t Socket::send_file(const int fd, off_t& offset, const size_t count)
+{
+    while(true) {
+        const ssize_t rc = ::sendfile(_fd, fd, &offset, count);
+        if(rc >= 0) {
+            return rc;
+        }
+        if(errno == EINTR) {
+            continue;
+        }
+        if((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        throw std::runtime_error("sendfile() has failed");
+    }
+}
+
 bool Socket::get_acceptconn() const
 {
     int       option_val = 0;
@@ -447,6 +594,27 @@ void Socket::set_reuseaddr(const bool value) const
     }
 }
 
+bool Socket::get_reuseport() const
+{
+    int       option_val = 0;
+    socklen_t option_len = sizeof(option_val);
+    const int rc = ::getsockopt(_fd, SOL_SOCKET, SO_REUSEPORT, &option_val, &option_len);
+    if(rc < 0) {
+        throw std::runtime_error("getsockopt() has failed");
+    }
+    return option_val;
+}
+
+void Socket::set_reuseport(const bool value) const
+{
+    int       option_val = value;
+    socklen_t option_len = sizeof(option_val);
+    const int rc = ::setsockopt(_fd, SOL_SOCKET, SO_REUSEPORT, &option_val, option_len);
+    if(rc < 0) {
+        throw std::runtime_error("setsockopt() has failed");
+    }
+}
+
 int Socket::get_sndbuf() const
 {
     int       option_val = 0;
@@ -490,200 +658,4651 @@ void Socket::set_rcvbuf(const int value) const
 }
 
 // ---------------------------------------------------------------------------
-// ChatServer
+// MemoryPool
 // ---------------------------------------------------------------------------
 
-ChatServer::ChatServer()
-    : SignalListener()
-    , _signal_manager(*this)
-    , _server()
-    , _clients()
-    , _quit(false)
+namespace {
+
+constexpr size_t POOL_CLASSES = 9;
+constexpr size_t POOL_BATCH   = 32;
+
+struct PoolBlock
+{
+    PoolBlock* next;
+};
+
+struct PoolDepot
+{
+    std::mutex mutex;
+    PoolBlock* head;
+};
+
+struct PoolCache
+{
+    PoolBlock* head[POOL_CLASSES];
+    size_t     count[POOL_CLASSES];
+
+    PoolCache();
+
+    ~PoolCache();
+};
+
+PoolDepot             pool_depots[POOL_CLASSES];
+std::atomic<uint64_t> pool_heap_allocations(0);
+std::atomic<uint64_t> pool_pooled_allocations(0);
+
+thread_local PoolCache pool_cache;
+
+size_t pool_class(const size_t size)
 {
+    if(size <= MemoryPool::MIN_BLOCK) {
+        return 0;
+    }
+    /* smallest power of two holding size, counted from MIN_BLOCK */
+    return (64 - __builtin_clzl(size - 1)) - 6;
 }
 
-void ChatServer::run(const uint32_t addr, const uint16_t port)
+size_t pool_class_size(const size_t index)
+{
+    return MemoryPool::MIN_BLOCK << index;
+}
+
+void pool_release_batch(const size_t index, PoolCache& cache)
 {
-    std::cout << "ChatServer::run()" << std::endl;
-    //std::s
-    _server.create();
-    _server.set_reuseaddr(true);
-    _server.bind(addr, port);
-    _server.listen(5);
+    /* hand a batch of blocks back to the depot so other threads can reuse them */
+    PoolBlock* first = cache.head[index];
+    PoolBlock* last  = first;
+    for(size_t count = 1; count < POOL_BATCH; ++count) {
+        last = last->next;
+    }
+    cache.head[index]   = last->next;
+    cache.count[index] -= POOL_BATCH;
 
-    //std::vector<pollfd> pollfds;
-    _pollfds.push_back({_server.fd(), POLLIN, 0});
-    _pollfds.push_back({STDIN_FILENO, POLLIN, 0});
+    PoolDepot& depot(pool_depots[index]);
+    const std::lock_guard<std::mutex> lock(depot.mutex);
+    last->next = depot.head;
+    depot.head = first;
+}
 
-    while (!_quit) {
+bool pool_acquire_batch(const size_t index, PoolCache& cache)
+{
+    PoolDepot& depot(pool_depots[index]);
+    const std::lock_guard<std::mutex> lock(depot.mutex);
+    for(size_t count = 0; (count < POOL_BATCH) && (depot.head != nullptr); ++count) {
+        PoolBlock* block = depot.head;
+        depot.head = block->next;
+        block->next = cache.head[index];
+        cache.head[index] = block;
+        ++cache.count[index];
+    }
+    return cache.head[index] != nullptr;
+}
 
-        if (_signal_manager.timedwait(1000)) {
-            continue;
+PoolCache::PoolCache()
+    : head()
+    , count()
+{
+}
+
+PoolCache::~PoolCache()
+{
+    for(size_t index = 0; index < POOL_CLASSES; ++index) {
+        while(head[index] != nullptr) {
+            PoolBlock* block = head[index];
+            head[index] = block->next;
+            PoolDepot& depot(pool_depots[index]);
+            const std::lock_guard<std::mutex> lock(depot.mutex);
+            block->next = depot.head;
+            depot.head = block;
         }
+        count[index] = 0;
+    }
+}
+
+}
+
+void* MemoryPool::allocate(const size_t size)
+{
+    if(size > MAX_BLOCK) {
+        pool_heap_allocations.fetch_add(1, std::memory_order_relaxed);
+        return ::operator new(size);
+    }
+    pool_pooled_allocations.fetch_add(1, std::memory_order_relaxed);
+
+    const size_t index = pool_class(size);
+    PoolCache&   cache(pool_cache);
+    if((cache.head[index] == nullptr) && !pool_acquire_batch(index, cache)) {
+        pool_heap_allocations.fetch_add(1, std::memory_order_relaxed);
+        return ::operator new(pool_class_size(index));
+    }
+    PoolBlock* block = cache.head[index];
+    cache.head[index] = block->next;
+    --cache.count[index];
+    return block;
+}
+
+void MemoryPool::deallocate(void* block, const size_t size)
+{
+    if(block == nullptr) {
+        return;
+    }
+    if(size > MAX_BLOCK) {
+        ::operator delete(block);
+        return;
+    }
+    /* blocks are never given back to the heap, only recycled */
+    const size_t index = pool_class(size);
+    PoolCache&   cache(pool_cache);
+    PoolBlock*   free_block = static_cast<PoolBlock*>(block);
+    free_block->next  = cache.head[index];
+    cache.head[index] = free_block;
+    if(++cache.count[index] > (2 * POOL_BATCH)) {
+        pool_release_batch(index, cache);
+    }
+}
+
+uint64_t MemoryPool::heap_allocations()
+{
+    return pool_heap_allocations.load(std::memory_order_relaxed);
+}
+
+uint64_t MemoryPool::pool_allocations()
+{
+    return pool_pooled_allocations.load(std::memory_order_relaxed);
+}
+
+void MemoryPool::dump(std::ostream& stream)
+{
+    stream << "pool"
+           << ": allocations=" << pool_allocations()
+           << " heap_allocations=" << heap_allocations()
+           << std::endl;
+}
+
+// ---------------------------------------------------------------------------
+// Logger
+// ---------------------------------------------------------------------------
+
+namespace {
+
+constexpr size_t   LOGGER_RECORDS = 4096;
+constexpr size_t   LOGGER_TEXT    = 208;
+constexpr uint64_t LOGGER_GRACE   = 100000000UL;
+
+struct LoggerRecord
+{
+    std::atomic<size_t> sequence;
+    uint64_t            time;
+    const char*         format;
+    int64_t             args[2];
+    uint16_t            length;
+    uint8_t             level;
+    char                text[LOGGER_TEXT];
+};
+
+static_assert(sizeof(LoggerRecord) == 256, "a log record must fill four cache lines");
+
+struct LoggerRing
+{
+    LoggerRecord records[LOGGER_RECORDS];
+
+    LoggerRing();
+};
+
+LoggerRing                 logger_ring;
+std::atomic<size_t>        logger_tail(0);
+size_t                     logger_head(0);
+std::atomic<uint8_t>       logger_level(Logger::INFO);
+std::atomic<bool>          logger_running(false);
+std::atomic<bool>          logger_stopping(false);
+std::atomic<bool>          logger_reopening(false);
+std::atomic<uint64_t>      logger_dropped(0);
+uint64_t                   logger_reported(0);
+std::string                logger_path;
+int                        logger_fd(-1);
+std::thread                logger_thread;
+
+LoggerRing::LoggerRing()
+{
+    /* a record is free for the producer at position p when its sequence is p */
+    for(size_t index = 0; index < LOGGER_RECORDS; ++index) {
+        records[index].sequence.store(index, std::memory_order_relaxed);
+    }
+}
+
+uint64_t logger_clock()
+{
+    timespec now = {};
+    static_cast<void>(::clock_gettime(CLOCK_REALTIME, &now));
+    return (static_cast<uint64_t>(now.tv_sec) * 1000000000UL) + static_cast<uint64_t>(now.tv_nsec);
+}
+
+const char* logger_name(const uint8_t level)
+{
+    switch(level) {
+        case Logger::DEBUG:
+            return "DEBUG";
+        case Logger::INFO:
+            return "INFO";
+        case Logger::WARN:
+            return "WARN";
+        default:
+            break;
+    }
+    return "ERROR";
+}
+
+void logger_format(std::string& output, const uint64_t time, const uint8_t level, const char* format, const int64_t* args, const char* text, const size_t length)
+{
+    char      line[512];
+    const time_t seconds = static_cast<time_t>(time / 1000000000UL);
+    tm        local = {};
+    static_cast<void>(::localtime_r(&seconds, &local));
+    size_t size = ::strftime(line, sizeof(line), "%Y-%m-%d %H:%M:%S", &local);
+    size += ::snprintf(line + size, sizeof(line) - size, ".%06u %-5s ", static_cast<unsigned>((time % 1000000000UL) / 1000), logger_name(level));
+    const int rc = ::snprintf(line + size, sizeof(line) - size, format, static_cast<long long>(args[0]), static_cast<long long>(args[1]));
+    size = std::min(size + std::max(rc, 0), sizeof(line) - 1);
+    output.append(line, size);
+    output.append(text, length);
+    output.push_back('\n');
+}
 
-        int poll_count = poll(_pollfds.data(), _pollfds.size(), -1);
-        if (poll_count < 0) {
-            perror("Poll failed");
+void logger_write(const int fd, std::string& output)
+{
+    size_t offset = 0;
+    while(offset < output.size()) {
+        const ssize_t rc = ::write(fd, output.data() + offset, output.size() - offset);
+        if(rc < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
             break;
         }
+        offset += rc;
+    }
+    output.clear();
+}
 
-        for (size_t i = 0; i < _pollfds.size(); ++i) {
-            if (_pollfds[i].revents & POLLIN) {
-                // Nouveau client en attente de connexion
-                if (_pollfds[i].fd == _server.fd()) {
-                    int client_fd = _server.accept();
-                    _clients.emplace_back(client_fd);
+void logger_open()
+{
+    if(logger_path.empty()) {
+        return;
+    }
+    const int fd = ::open(logger_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        /* keep writing to the previous file rather than losing records */
+        return;
+    }
+    if(logger_fd >= 0) {
+        static_cast<void>(::close(logger_fd));
+    }
+    logger_fd = fd;
+}
 
-                    std::cout << "New client connected: " << client_fd << std::endl;
+size_t logger_drain(std::string& out, std::string& err)
+{
+    size_t count = 0;
+    while(true) {
+        LoggerRecord& record(logger_ring.records[logger_head & (LOGGER_RECORDS - 1)]);
+        if(record.sequence.load(std::memory_order_acquire) != (logger_head + 1)) {
+            break;
+        }
+        std::string& output((logger_fd < 0) && (record.level >= Logger::WARN) ? err : out);
+        logger_format(output, record.time, record.level, record.format, record.args, record.text, record.length);
+        /* the record is handed back to producers one lap later */
+        record.sequence.store(logger_head + LOGGER_RECORDS, std::memory_order_release);
+        ++logger_head;
+        ++count;
+    }
+    const uint64_t dropped = logger_dropped.load(std::memory_order_relaxed);
+    if(dropped != logger_reported) {
+        const int64_t args[2] = {static_cast<int64_t>(dropped - logger_reported), 0};
+        logger_format((logger_fd < 0 ? err : out), logger_clock(), Logger::WARN, "%lld log records dropped", args, nullptr, 0);
+        logger_reported = dropped;
+    }
+    logger_write((logger_fd < 0 ? STDOUT_FILENO : logger_fd), out);
+    logger_write(STDERR_FILENO, err);
+    return count;
+}
 
-                    // Ajouter le client à la liste
-                    _pollfds.push_back({client_fd, POLLIN, 0});
-                }
-                else if (_pollfds[i].fd == STDIN_FILENO) {
-                    std::string input;
-                    if (!std::getline(std::cin, input)) {
-                        std::cout << "Error reading from stdin" << std::endl;
-                        continue;
-                    }
-                    if (input == "quit") {
-                        quit();
-                    }
-                    else if (!input.empty()){
-                        input.append("\r\n");
-                        for (auto& client : _clients) {
-                            sendMsgToClient(client, input);
-                        }
-                    }
-                }
-                // Données reçues d'un client
-                else {
-                    char buffer[1024];
-                    int bytes_read = recv(_pollfds[i].fd, buffer, sizeof(buffer) - 1, 0);
-                    if (bytes_read <= 0) {
-                        // Client déconnecté
-                        std::cout << "Client disconnected: " << _pollfds[i].fd << std::endl;
-                        close(_pollfds[i].fd);
-                        _pollfds.erase(_pollfds.begin() + i);
-                        for (auto it = _clients.begin(); it != _clients.end(); ++it) {
-                            if (it->fd() == _pollfds[i].fd) {
-                                _clients.erase(it);
-                                break;
-                            }
-                        }
-                        --i;
-                    } else {
-                        // Traiter et répondre au client
-                        buffer[bytes_read-1] = '\0';
-                        std::cout << "Message from client " << _pollfds[i].fd << ": " << buffer << std::endl;
-                    }
-                }
+void logger_run()
+{
+    std::string out;
+    std::string err;
+    uint64_t    deadline = 0;
+    while(true) {
+        const bool stopping = logger_stopping.load(std::memory_order_acquire);
+        if(logger_reopening.exchange(false)) {
+            logger_open();
+        }
+        /*
+         * once stopping, records claimed but not yet published are waited for, but not
+         * forever: a producer stuck in between only costs the records it holds up
+         */
+        if((logger_drain(out, err) == 0) && stopping) {
+            const size_t claimed = logger_tail.load(std::memory_order_acquire);
+            if(claimed == logger_head) {
+                break;
+            }
+            if(deadline == 0) {
+                deadline = logger_clock() + LOGGER_GRACE;
+            }
+            else if(logger_clock() >= deadline) {
+                logger_dropped.fetch_add(claimed - logger_head, std::memory_order_relaxed);
+                static_cast<void>(logger_drain(out, err));
+                break;
             }
         }
+        /* the writer polls, producers never pay for a wakeup */
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
     }
+}
 
 }
 
+void Logger::start(const std::string& path, const Level level)
+{
+    logger_level = level;
+    logger_path  = path;
+    logger_open();
+    if(!logger_path.empty() && (logger_fd < 0)) {
+        throw std::runtime_error("open() has failed");
+    }
+    logger_stopping = false;
+    logger_thread   = std::thread(&logger_run);
+    logger_running  = true;
+}
 
-void ChatServer::cont()
+void Logger::stop()
+{
+    if(!logger_running.exchange(false)) {
+        return;
+    }
+    logger_stopping = true;
+    logger_thread.join();
+    if(logger_fd >= 0) {
+        logger_fd = (::close(logger_fd), -1);
+    }
+}
+
+void Logger::reopen()
 {
+    logger_reopening = true;
 }
 
-void ChatServer::quit()
+void Logger::log(const Level level, const char* format, const int64_t arg0, const int64_t arg1)
+{
+    log(level, format, arg0, arg1, nullptr, 0);
+}
+
+void Logger::log(const Level level, const char* format, const int64_t arg0, const int64_t arg1, const char* text)
 {
-    _server.close();
-    for (Socket _client : _clients) {
-        _client.close();
+    log(level, format, arg0, arg1, text, ::strlen(text));
+}
+
+void Logger::log(const Level level, const char* format, const int64_t arg0, const int64_t arg1, const char* text, const size_t length)
+{
+    if(level < logger_level.load(std::memory_order_relaxed)) {
+        return;
     }
-    _quit = true;
+    const size_t  size    = std::min(length, LOGGER_TEXT);
+    const int64_t args[2] = {arg0, arg1};
+    if(!logger_running.load(std::memory_order_acquire)) {
+        /* before start() and after stop() records are written in place */
+        std::string output;
+        logger_format(output, logger_clock(), level, format, args, text, length);
+        logger_write((level >= WARN ? STDERR_FILENO : STDOUT_FILENO), output);
+        return;
+    }
+    /* claim a record, the format string is static and only the text is copied */
+    size_t        position = logger_tail.load(std::memory_order_relaxed);
+    LoggerRecord* record   = nullptr;
+    while(true) {
+        record = &logger_ring.records[position & (LOGGER_RECORDS - 1)];
+        const size_t    sequence = record->sequence.load(std::memory_order_acquire);
+        const ptrdiff_t distance = static_cast<ptrdiff_t>(sequence - position);
+        if(distance == 0) {
+            if(logger_tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if(distance < 0) {
+            /* the ring is full, the record is dropped rather than stalling the caller */
+            logger_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        else {
+            position = logger_tail.load(std::memory_order_relaxed);
+        }
+    }
+    record->time    = logger_clock();
+    record->format  = format;
+    record->args[0] = arg0;
+    record->args[1] = arg1;
+    record->length  = size;
+    record->level   = level;
+    if(size != 0) {
+        ::memcpy(record->text, text, size);
+    }
+    record->sequence.store(position + 1, std::memory_order_release);
 }
 
-void ChatServer::sendMsgToClient(Socket& client, std::string msg) {
-    try {
-        client.send(msg);
-    } catch (const std::exception& e) {
-        printf("%s", e.what());
-        _pollfds.erase(std::remove_if(_pollfds.begin(), _pollfds.end(),[&client](const pollfd& pfd) {
-                return pfd.fd == client.fd();
-            }), _pollfds.end());
-        _clients.remove_if([&client](const Socket& c) {
-            return c.fd() == client.fd();
-        });
+void Logger::log_lines(const Level level, const std::string& text)
+{
+    /* one record per line, a line longer than a record is split at its last space that fits */
+    const char* begin = text.data();
+    const char* end   = begin + text.size();
+    while(begin < end) {
+        const char* eol = static_cast<const char*>(::memchr(begin, '\n', end - begin));
+        const char* cut = (eol != nullptr ? eol : end);
+        if(static_cast<size_t>(cut - begin) > LOGGER_TEXT) {
+            cut = begin + LOGGER_TEXT;
+            for(const char* at = cut; at > begin; --at) {
+                if(*at == ' ') {
+                    cut = at;
+                    break;
+                }
+            }
+        }
+        log(level, "", 0, 0, begin, cut - begin);
+        begin = cut;
+        while((begin < end) && ((*begin == '\n') || (*begin == ' '))) {
+            ++begin;
+        }
     }
 }
 
-void ChatServer::onSigHgup()
+uint64_t Logger::dropped()
 {
-    std::cout << "SIGHGUP" << std::endl;
-    quit();
+    return logger_dropped.load(std::memory_order_relaxed);
 }
 
-void ChatServer::onSigIntr()
+auto Logger::level(const std::string& name) -> Level
 {
-    std::cout << "SIGINTR" << std::endl;
-    quit();
+    if(name == "debug") {
+        return DEBUG;
+    }
+    if(name == "info") {
+        return INFO;
+    }
+    if(name == "warn") {
+        return WARN;
+    }
+    if(name == "error") {
+        return ERROR;
+    }
+    throw std::runtime_error("invalid log level <" + name + ">");
 }
 
-void ChatServer::onSigTerm()
+// ---------------------------------------------------------------------------
+// Message
+// ---------------------------------------------------------------------------
+
+auto Message::create(const char* data, const size_t size) -> MessagePtr
 {
-    std::cout << "SIGTERM" << std::endl;
-    quit();
+    /* header and payload share a single pooled block */
+    void* block = MemoryPool::allocate(sizeof(Message) + size);
+    char* payload = static_cast<char*>(block) + sizeof(Message);
+    Message* message = new(block) Message(payload, size, nullptr, 0);
+    ::memcpy(payload, data, size);
+    return MessagePtr(message);
 }
 
-void ChatServer::onSigPipe()
+auto Message::create(const std::string& string) -> MessagePtr
 {
-    std::cout << "SIGPIPE" << std::endl;
-    quit();
+    return create(string.data(), string.size());
 }
 
-void ChatServer::onSigChld()
+auto Message::create_line(const char* data, const size_t size) -> MessagePtr
 {
-    std::cout << "SIGCHLD" << std::endl;
-    quit();
+    return create_line(data, size, 0);
 }
 
-void ChatServer::onSigAlrm()
+auto Message::create_line(const char* data, const size_t size, const uint64_t stamp) -> MessagePtr
 {
-    std::cout << "SIGALRM" << std::endl;
-    cont();
+    void* block = MemoryPool::allocate(sizeof(Message) + size + 2);
+    char* payload = static_cast<char*>(block) + sizeof(Message);
+    Message* message = new(block) Message(payload, size + 2, nullptr, stamp);
+    ::memcpy(payload, data, size);
+    payload[size + 0] = '\r';
+    payload[size + 1] = '\n';
+    return MessagePtr(message);
 }
 
-void ChatServer::onSigUsr1()
+auto Message::create_view(const SharedRegion& region, const char* data, const size_t size) -> MessagePtr
 {
-    std::cout << "SIGUSR1" << std::endl;
-    cont();
+    /* the payload stays in the region, which is kept alive as long as the message */
+    void* block = MemoryPool::allocate(sizeof(Message));
+    Message* message = new(block) Message(data, size, &region, 0);
+    region.retain();
+    return MessagePtr(message);
 }
 
-void ChatServer::onSigUsr2()
+void Message::destroy(const Message* message)
 {
-    std::cout << "SIGUSR2" << std::endl;
-    cont();
+    const SharedRegion* region = message->_region;
+    const size_t size = sizeof(Message) + (region != nullptr ? 0 : message->size());
+    message->~Message();
+    MemoryPool::deallocate(const_cast<Message*>(message), size);
+    if(region != nullptr) {
+        region->release();
+    }
 }
 
 // ---------------------------------------------------------------------------
-// main
+// MessageQueue
 // ---------------------------------------------------------------------------
 
-int main(int argc, char* argv[])
+void MessageQueue::push_back(const MessagePtr& msg)
 {
-    const uint32_t addr = INADDR_ANY;
-    const uint16_t port = 1976;
-
-    try {
-        ChatServer chat_server;
-
-        chat_server.run(addr, port);
+    if(_count == _ring.size()) {
+        /* grow to the next power of two and unroll the ring */
+        Ring ring(std::max<size_t>(_ring.size() * 2, 8));
+        for(size_t index = 0; index < _count; ++index) {
+            ring[index] = std::move(_ring[(_head + index) & (_ring.size() - 1)]);
+        }
+        _ring.swap(ring);
+        _head = 0;
     }
-    catch(const std::exception& e) {
-        const char* what(e.what());
-        std::cerr << "error: " << what << std::endl;
-        return EXIT_FAILURE;
+    _ring[(_head + _count) & (_ring.size() - 1)] = msg;
+    _bytes += msg->size();
+    ++_count;
+}
+
+size_t MessageQueue::gather(iovec* iov, const size_t count) const
+{
+    const size_t limit = std::min(count, _count);
+    size_t offset = _offset;
+    for(size_t index = 0; index < limit; ++index) {
+        const Message& msg(*_ring[(_head + index) & (_ring.size() - 1)]);
+        iov[index].iov_base = const_cast<char*>(msg.data() + offset);
+        iov[index].iov_len  = msg.size() - offset;
+        offset = 0;
+    }
+    return limit;
+}
+
+size_t MessageQueue::consume(size_t size)
+{
+    size_t completed = 0;
+    while((size > 0) && (_count > 0)) {
+        const size_t remaining = _ring[_head]->size() - _offset;
+        if(size < remaining) {
+            _offset += size;
+            _bytes  -= size;
+            break;
+        }
+        size   -= remaining;
+        _bytes -= remaining;
+        _ring[_head].reset();
+        _head   = (_head + 1) & (_ring.size() - 1);
+        _offset = 0;
+        --_count;
+        ++completed;
+    }
+    return completed;
+}
+
+bool MessageQueue::drop_oldest(size_t& position)
+{
+    /* a partially sent message must be completed to keep the stream consistent,
+     * and pinned messages are still referenced by an in-flight send request;
+     * the position of the dropped message, from the head, is reported */
+    const size_t locked = std::max(_pinned, static_cast<size_t>(_offset != 0 ? 1 : 0));
+    if(_count <= locked) {
+        return false;
+    }
+    const size_t mask   = _ring.size() - 1;
+    const size_t victim = (_head + locked) & mask;
+    position = locked;
+    _bytes -= _ring[victim]->size();
+    for(size_t index = locked; index > 0; --index) {
+        _ring[(_head + index) & mask] = std::move(_ring[(_head + index - 1) & mask]);
+    }
+    _ring[_head].reset();
+    _head = (_head + 1) & mask;
+    --_count;
+    return true;
+}
+
+void MessageQueue::clear()
+{
+    for(auto& msg : _ring) {
+        msg.reset();
+    }
+    _head   = 0;
+    _count  = 0;
+    _offset = 0;
+    _bytes  = 0;
+    _pinned = 0;
+}
+
+// ---------------------------------------------------------------------------
+// MessageRing
+// ---------------------------------------------------------------------------
+
+void MessageRing::push(const MessagePtr& msg)
+{
+    if(_ring.empty()) {
+        return;
+    }
+    /* the oldest message is overwritten once the ring is full */
+    const std::lock_guard<std::mutex> lock(_mutex);
+    _ring[(_head + _count) % _ring.size()] = msg;
+    if(_count < _ring.size()) {
+        ++_count;
+    }
+    else {
+        _head = (_head + 1) % _ring.size();
+    }
+}
+
+void MessageRing::snapshot(std::vector<MessagePtr>& result)
+{
+    const std::lock_guard<std::mutex> lock(_mutex);
+    for(size_t index = 0; index < _count; ++index) {
+        result.push_back(_ring[(_head + index) % _ring.size()]);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// AdmissionFilter
+// ---------------------------------------------------------------------------
+
+AdmissionFilter::AdmissionFilter(const double rate, const double burst, const size_t limit)
+    : _rate(rate)
+    , _burst(std::max(burst, 1.0))
+    , _limit(limit)
+    , _mutex()
+    , _buckets()
+    , _order()
+    , _swept(0)
+{
+}
+
+bool AdmissionFilter::admit(const uint32_t addr, const uint64_t now)
+{
+    /* every source address owns a bucket refilled at the admission rate, a connection takes a token */
+    const std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _buckets.find(addr);
+    if(it == _buckets.end()) {
+        /*
+         * a full table is swept at most once a second, meanwhile the least recently
+         * seen source makes room, so that a newcomer is never left untracked
+         */
+        if((_buckets.size() >= _limit) && ((now - _swept) >= 1000000000UL)) {
+            sweep(now);
+        }
+        while(_buckets.size() >= _limit) {
+            _buckets.erase(_order.front());
+            _order.pop_front();
+        }
+        it = _buckets.emplace(addr, Bucket{_burst, now, _order.insert(_order.end(), addr)}).first;
+    }
+    else {
+        /* a source knocking again, refused or not, moves away from eviction */
+        _order.splice(_order.end(), _order, it->second.position);
+    }
+    Bucket& bucket(it->second);
+    bucket.tokens = std::min(_burst, bucket.tokens + (((now - bucket.stamp) * 1e-9) * _rate));
+    bucket.stamp  = now;
+    if(bucket.tokens < 1.0) {
+        return false;
+    }
+    bucket.tokens -= 1.0;
+    return true;
+}
+
+size_t AdmissionFilter::size()
+{
+    const std::lock_guard<std::mutex> lock(_mutex);
+    return _buckets.size();
+}
+
+void AdmissionFilter::sweep(const uint64_t now)
+{
+    /* a bucket refilled by now holds nothing worth remembering, unknown sources start full */
+    for(auto it = _buckets.begin(); it != _buckets.end();) {
+        const Bucket& bucket(it->second);
+        if((bucket.tokens + (((now - bucket.stamp) * 1e-9) * _rate)) >= _burst) {
+            _order.erase(bucket.position);
+            it = _buckets.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+    _swept = now;
+}
+
+// ---------------------------------------------------------------------------
+// MessageLog
+// ---------------------------------------------------------------------------
+
+namespace {
+
+constexpr size_t log_alignment = 8;
+
+size_t log_align(const size_t size)
+{
+    return (size + (log_alignment - 1)) & ~(log_alignment - 1);
+}
+
+uint64_t log_clock(const clockid_t clock, const uint64_t unit)
+{
+    timespec now = {};
+    static_cast<void>(::clock_gettime(clock, &now));
+    return (static_cast<uint64_t>(now.tv_sec) * unit) + (static_cast<uint64_t>(now.tv_nsec) / (1000000000UL / unit));
+}
+
+std::string log_path(const std::string& directory, const uint64_t first)
+{
+    char name[64];
+    static_cast<void>(::snprintf(name, sizeof(name), "history-%020llu.log", static_cast<unsigned long long>(first)));
+    return directory + '/' + name;
+}
+
+}
+
+MessageLog::Segment::Segment(const std::string& path, const uint64_t first, const size_t capacity)
+    : SharedRegion()
+    , _fd(-1)
+    , _base(nullptr)
+    , _capacity(capacity)
+    , _synced(0)
+    , _first(first)
+{
+    _fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(_fd < 0) {
+        throw std::runtime_error("open() has failed");
+    }
+    /* an existing segment is mapped as is, a new one is extended with zeroes */
+    struct stat status = {};
+    if(::fstat(_fd, &status) != 0) {
+        _fd = (::close(_fd), -1);
+        throw std::runtime_error("fstat() has failed");
+    }
+    if(status.st_size > 0) {
+        _capacity = status.st_size;
+    }
+    else if(::ftruncate(_fd, _capacity) != 0) {
+        _fd = (::close(_fd), -1);
+        throw std::runtime_error("ftruncate() has failed");
+    }
+    void* base = ::mmap(nullptr, _capacity, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if(base == MAP_FAILED) {
+        _fd = (::close(_fd), -1);
+        throw std::runtime_error("mmap() has failed");
+    }
+    _base = static_cast<char*>(base);
+}
+
+MessageLog::Segment::~Segment()
+{
+    if(_base != nullptr) {
+        _base = (::munmap(_base, _capacity), nullptr);
+    }
+    if(_fd >= 0) {
+        _fd = (::close(_fd), -1);
+    }
+}
+
+void MessageLog::Segment::sync(const size_t used, const bool wait)
+{
+    /* msync() wants a page aligned address, start from the page of the first unsynced byte */
+    const size_t page  = ::sysconf(_SC_PAGESIZE);
+    const size_t start = _synced & ~(page - 1);
+    if(used > start) {
+        static_cast<void>(::msync(_base + start, used - start, (wait ? MS_SYNC : MS_ASYNC)));
+    }
+    _synced = used;
+}
+
+void MessageLog::Segment::truncate(const size_t used)
+{
+    /* views may still reference the mapping, only the unused tail of the file is released */
+    if(used < _capacity) {
+        static_cast<void>(::ftruncate(_fd, used));
+    }
+}
+
+MessageLog::MessageLog(const std::string& directory, const size_t segment_size, const size_t max_segments, const size_t max_replay)
+    : _mutex()
+    , _directory(directory)
+    , _segment_size(log_align(segment_size))
+    , _max_segments(std::max(max_segments, static_cast<size_t>(1)))
+    , _max_replay(max_replay)
+    , _segments()
+    , _index()
+    , _used(0)
+    , _sequence(1)
+    , _synced_at(log_clock(CLOCK_MONOTONIC, 1000))
+{
+    if((::mkdir(_directory.c_str(), 0755) != 0) && (errno != EEXIST)) {
+        throw std::runtime_error("mkdir() has failed");
+    }
+    recover();
+}
+
+MessageLog::~MessageLog()
+{
+    sync();
+    for(const Segment* segment : _segments) {
+        segment->release();
+    }
+}
+
+uint64_t MessageLog::append(const Message& msg)
+{
+    const size_t length = log_align(sizeof(Record) + msg.size());
+    if(length > _segment_size) {
+        return 0;
+    }
+    const std::lock_guard<std::mutex> lock(_mutex);
+    Segment* segment = (_segments.empty() ? nullptr : _segments.back());
+    if((segment == nullptr) || ((_used + length) > segment->capacity())) {
+        segment = rotate();
+    }
+    char*   at     = segment->base() + _used;
+    Record* record = reinterpret_cast<Record*>(at);
+    record->sequence  = _sequence;
+    record->timestamp = log_clock(CLOCK_REALTIME, 1000000);
+    record->reserved  = 0;
+    ::memcpy(at + sizeof(Record), msg.data(), msg.size());
+    /* the size is stored last, a null size marks the end of a segment */
+    __atomic_store_n(&record->size, static_cast<uint32_t>(msg.size()), __ATOMIC_RELEASE);
+    _index.push_back(Position{segment, _used});
+    if(_index.size() > _max_replay) {
+        _index.pop_front();
+    }
+    _used += length;
+    /* the kernel writes dirty pages back anyway, but no later than a second after they were logged */
+    const uint64_t now = log_clock(CLOCK_MONOTONIC, 1000);
+    if((now - _synced_at) >= 1000) {
+        segment->sync(_used, false);
+        _synced_at = now;
+    }
+    return _sequence++;
+}
+
+void MessageLog::replay(const size_t count, std::vector<MessagePtr>& result)
+{
+    /* records are handed out as views on the mapped segments, nothing is copied */
+    const std::lock_guard<std::mutex> lock(_mutex);
+    const size_t first = _index.size() - std::min(count, _index.size());
+    for(size_t position = first; position < _index.size(); ++position) {
+        const Position& entry(_index[position]);
+        const char*     at     = entry.segment->base() + entry.offset;
+        const Record*   record = reinterpret_cast<const Record*>(at);
+        result.push_back(Message::create_view(*entry.segment, at + sizeof(Record), record->size));
+    }
+}
+
+void MessageLog::sync()
+{
+    const std::lock_guard<std::mutex> lock(_mutex);
+    if(!_segments.empty()) {
+        _segments.back()->sync(_used, true);
+    }
+}
+
+void MessageLog::recover()
+{
+    DIR* directory = ::opendir(_directory.c_str());
+    if(directory == nullptr) {
+        throw std::runtime_error("opendir() has failed");
+    }
+    std::vector<uint64_t> firsts;
+    while(const dirent* entry = ::readdir(directory)) {
+        unsigned long long first = 0;
+        char               tail  = '\0';
+        if(::sscanf(entry->d_name, "history-%20llu.lo%c", &first, &tail) == 2) {
+            firsts.push_back(first);
+        }
+    }
+    static_cast<void>(::closedir(directory));
+    std::sort(firsts.begin(), firsts.end());
+    /* segments beyond the retained ones would never be read again, they are removed */
+    if(firsts.size() > _max_segments) {
+        for(auto it = firsts.begin(); it != (firsts.end() - _max_segments); ++it) {
+            static_cast<void>(::unlink(log_path(_directory, *it).c_str()));
+        }
+        firsts.erase(firsts.begin(), firsts.end() - _max_segments);
+    }
+    /* walk the retained segments to rebuild the replay index and find where to resume */
+    for(const uint64_t first : firsts) {
+        Segment* segment = new Segment(log_path(_directory, first), first, _segment_size);
+        segment->retain();
+        _segments.push_back(segment);
+        size_t offset = 0;
+        while((offset + sizeof(Record)) <= segment->capacity()) {
+            const Record* record = reinterpret_cast<const Record*>(segment->base() + offset);
+            if((record->size == 0) || ((offset + sizeof(Record) + record->size) > segment->capacity())) {
+                break;
+            }
+            _index.push_back(Position{segment, offset});
+            if(_index.size() > _max_replay) {
+                _index.pop_front();
+            }
+            _sequence = record->sequence + 1;
+            offset += log_align(sizeof(Record) + record->size);
+        }
+        _used = offset;
+    }
+}
+
+auto MessageLog::rotate() -> Segment*
+{
+    if(!_segments.empty()) {
+        Segment* current = _segments.back();
+        current->sync(_used, false);
+        current->truncate(_used);
+    }
+    Segment* segment = new Segment(log_path(_directory, _sequence), _sequence, _segment_size);
+    segment->retain();
+    _segments.push_back(segment);
+    _used = 0;
+    retire();
+    return segment;
+}
+
+void MessageLog::retire()
+{
+    /* older segments are removed from disk at once, but only unmapped once no view references them */
+    while(_segments.size() > _max_segments) {
+        const Segment* segment = _segments.front();
+        while(!_index.empty() && (_index.front().segment == segment)) {
+            _index.pop_front();
+        }
+        _segments.pop_front();
+        static_cast<void>(::unlink(log_path(_directory, segment->first()).c_str()));
+        segment->release();
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Transcript
+// ---------------------------------------------------------------------------
+
+Transcript::Transcript(const std::string& path, const size_t stride)
+    : _mutex()
+    , _stride(std::max(stride, static_cast<size_t>(1)))
+    , _fd(-1)
+    , _size(0)
+    , _count(0)
+    , _index()
+    , _queue()
+    , _batch()
+    , _iovecs()
+    , _queued(0)
+    , _written(0)
+    , _stopping(false)
+    , _thread()
+{
+    _fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(_fd < 0) {
+        throw std::runtime_error("open() has failed");
+    }
+    try {
+        recover();
+    } catch(...) {
+        _fd = (::close(_fd), -1);
+        throw;
+    }
+    _thread = std::thread(&Transcript::run, this);
+}
+
+Transcript::~Transcript()
+{
+    _stopping = true;
+    if(_thread.joinable()) {
+        _thread.join();
+    }
+    if(_fd != -1) {
+        static_cast<void>(::fdatasync(_fd));
+        _fd = (::close(_fd), -1);
+    }
+}
+
+void Transcript::append(const MessagePtr& msg)
+{
+    /* workers only queue the message, the writer thread takes it to the disk */
+    const std::lock_guard<std::mutex> lock(_mutex);
+    _queue.push_back(msg);
+    _queued.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Transcript::flush()
+{
+    /* whatever was queued so far is on disk when this returns */
+    const size_t queued = _queued.load(std::memory_order_relaxed);
+    while(_thread.joinable() && (_written.load(std::memory_order_acquire) < queued)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+void Transcript::run()
+{
+    while(true) {
+        const bool stopping = _stopping.load(std::memory_order_acquire);
+        if(!write() && stopping) {
+            break;
+        }
+        /* like the logger, the writer polls, workers never pay for a wakeup */
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+}
+
+bool Transcript::write()
+{
+    {
+        const std::lock_guard<std::mutex> lock(_mutex);
+        _batch.swap(_queue);
+    }
+    if(_batch.empty()) {
+        return false;
+    }
+    /* the batch leaves with as few writev() as possible, the lookups only see it once it is written */
+    off_t  size   = 0;
+    size_t offset = 0;
+    bool   failed = false;
+    while((offset < _batch.size()) && !failed) {
+        const size_t count = std::min(_batch.size() - offset, static_cast<size_t>(IOV_MAX));
+        _iovecs.resize(count);
+        for(size_t index = 0; index < count; ++index) {
+            _iovecs[index] = iovec{const_cast<char*>(_batch[offset + index]->data()), _batch[offset + index]->size()};
+        }
+        iovec* iov  = _iovecs.data();
+        size_t left = count;
+        while(left > 0) {
+            const ssize_t rc = ::writev(_fd, iov, left);
+            if(rc < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                failed = true;
+                break;
+            }
+            size_t done = rc;
+            while((left > 0) && (done >= iov->iov_len)) {
+                done -= iov->iov_len;
+                ++iov;
+                --left;
+            }
+            if(left > 0) {
+                iov->iov_base = static_cast<char*>(iov->iov_base) + done;
+                iov->iov_len -= done;
+            }
+        }
+        offset += count;
+    }
+    if(failed) {
+        /* a torn batch is cut off, the file has to end on the last indexed line */
+        static_cast<void>(::ftruncate(_fd, _size));
+        Logger::log(Logger::ERROR, "transcript write() has failed, %lld messages lost", _batch.size(), 0);
+    }
+    else {
+        const std::lock_guard<std::mutex> lock(_mutex);
+        for(const auto& msg : _batch) {
+            /* one offset every stride messages, a lookup scans at most a stride of lines */
+            if((_count % _stride) == 0) {
+                _index.push_back(_size + size);
+            }
+            size += msg->size();
+            _count += 1;
+        }
+        _size += size;
+    }
+    _written.fetch_add(_batch.size(), std::memory_order_release);
+    _batch.clear();
+    return true;
+}
+
+bool Transcript::locate(const uint64_t sequence, Range& range)
+{
+    off_t  start = 0;
+    size_t lines = 0;
+    {
+        const std::lock_guard<std::mutex> lock(_mutex);
+        range.end  = _size;
+        range.last = _count;
+        if((sequence > _count) || _index.empty()) {
+            range.offset = _size;
+            return false;
+        }
+        const uint64_t first = std::max(sequence, static_cast<uint64_t>(1)) - 1;
+        start = _index[first / _stride];
+        lines = first % _stride;
+    }
+    /* whatever precedes the end is never rewritten, it can be scanned unlocked */
+    range.offset = std::min(skip(start, lines), range.end);
+    return range.offset < range.end;
+}
+
+bool Transcript::seek(const off_t offset, Range& range)
+{
+    {
+        const std::lock_guard<std::mutex> lock(_mutex);
+        range.end  = _size;
+        range.last = _count;
+    }
+    /* an offset in the middle of a line is moved to the beginning of the next one */
+    if((offset <= 0) || (offset > range.end)) {
+        range.offset = std::min(std::max(offset, static_cast<off_t>(0)), range.end);
+    }
+    else {
+        range.offset = std::min(skip(offset - 1, 1), range.end);
+    }
+    return range.offset < range.end;
+}
+
+void Transcript::recover()
+{
+    std::vector<char> buffer(65536);
+    off_t position = 0;
+    off_t line     = 0;
+    while(true) {
+        const ssize_t rc = ::pread(_fd, buffer.data(), buffer.size(), position);
+        if(rc < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("pread() has failed");
+        }
+        if(rc == 0) {
+            break;
+        }
+        const char* begin = buffer.data();
+        const char* end   = begin + rc;
+        const char* at    = begin;
+        while((at = LineScanner::find(at, end)) != nullptr) {
+            if((_count % _stride) == 0) {
+                _index.push_back(line);
+            }
+            _count += 1;
+            line = position + (++at - begin);
+        }
+        position += rc;
+    }
+    /* a line torn by a crash is cut off, every message has to start on a line boundary */
+    if((line < position) && (::ftruncate(_fd, line) != 0)) {
+        throw std::runtime_error("ftruncate() has failed");
+    }
+    _size = line;
+}
+
+off_t Transcript::skip(off_t offset, size_t lines) const
+{
+    char buffer[4096];
+    while(lines > 0) {
+        const ssize_t rc = ::pread(_fd, buffer, sizeof(buffer), offset);
+        if(rc < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("pread() has failed");
+        }
+        if(rc == 0) {
+            break;
+        }
+        const char* at  = buffer;
+        const char* end = buffer + rc;
+        while((lines > 0) && (at != end)) {
+            const char* eol = LineScanner::find(at, end);
+            if(eol == nullptr) {
+                at = end;
+                break;
+            }
+            at = eol + 1;
+            lines -= 1;
+        }
+        offset += (at - buffer);
+    }
+    return offset;
+}
+
+// ---------------------------------------------------------------------------
+// LineScanner
+// ---------------------------------------------------------------------------
+
+const LineScanner::Function LineScanner::_function(LineScanner::select());
+
+auto LineScanner::select() -> Function
+{
+    if(has_avx2()) {
+        return &find_avx2;
+    }
+    if(has_sse2()) {
+        return &find_sse2;
+    }
+    return &find_memchr;
+}
+
+const char* LineScanner::name()
+{
+    if(_function == &find_avx2) {
+        return "avx2";
+    }
+    if(_function == &find_sse2) {
+        return "sse2";
+    }
+    return "memchr";
+}
+
+bool LineScanner::has_sse2()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+#else
+    return false;
+#endif
+}
+
+bool LineScanner::has_avx2()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+
+const char* LineScanner::find_naive(const char* begin, const char* end)
+{
+    for(const char* data = begin; data < end; ++data) {
+        if(*data == '\n') {
+            return data;
+        }
+    }
+    return nullptr;
+}
+
+const char* LineScanner::find_memchr(const char* begin, const char* end)
+{
+    return static_cast<const char*>(::memchr(begin, '\n', end - begin));
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("sse2")))
+const char* LineScanner::find_sse2(const char* begin, const char* end)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    const char*   data    = begin;
+
+    for(; (end - data) >= 16; data += 16) {
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+        const int     mask  = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+        if(mask != 0) {
+            return data + __builtin_ctz(mask);
+        }
+    }
+    return find_naive(data, end);
+}
+
+__attribute__((target("avx2")))
+const char* LineScanner::find_avx2(const char* begin, const char* end)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const char*   data    = begin;
+
+    /* two vectors per iteration, most chat lines fit in 64 bytes */
+    for(; (end - data) >= 64; data += 64) {
+        const __m256i chunk0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + 0));
+        const __m256i chunk1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + 32));
+        const uint32_t mask0 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk0, newline));
+        const uint32_t mask1 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk1, newline));
+        if((mask0 | mask1) != 0) {
+            if(mask0 != 0) {
+                return data + __builtin_ctz(mask0);
+            }
+            return data + 32 + __builtin_ctz(mask1);
+        }
+    }
+    for(; (end - data) >= 32; data += 32) {
+        const __m256i  chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+        const uint32_t mask  = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline));
+        if(mask != 0) {
+            return data + __builtin_ctz(mask);
+        }
+    }
+    return find_sse2(data, end);
+}
+
+#else
+
+const char* LineScanner::find_sse2(const char* begin, const char* end)
+{
+    return find_naive(begin, end);
+}
+
+const char* LineScanner::find_avx2(const char* begin, const char* end)
+{
+    return find_naive(begin, end);
+}
+
+#endif
+
+// ---------------------------------------------------------------------------
+// LineFramer
+// ---------------------------------------------------------------------------
+
+void LineFramer::reserve(const size_t size)
+{
+    /* move the pending partial line to the front before growing */
+    if(_head > 0) {
+        if(_tail > _head) {
+            ::memmove(_buffer.data(), _buffer.data() + _head, _tail - _head);
+        }
+        _tail -= _head;
+        _scan -= _head;
+        _head  = 0;
+    }
+    if(room() < size) {
+        _buffer.resize(_tail + size);
+    }
+}
+
+bool LineFramer::next(const char*& line, size_t& length)
+{
+    const char* data = _buffer.data();
+    /* bytes before _scan are already known to hold no delimiter */
+    const char* eol = LineScanner::find(data + _scan, data + _tail);
+    if(eol == nullptr) {
+        _scan = _tail;
+        return false;
+    }
+    const size_t end = eol - data;
+    line   = data + _head;
+    length = end - _head;
+    if((length > 0) && (line[length - 1] == '\r')) {
+        --length;
+    }
+    if(length > _max_length) {
+        _overflow = true;
+        return false;
+    }
+    _head = _scan = end + 1;
+    if(_head == _tail) {
+        _head = _tail = _scan = 0;
+    }
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Connection
+// ---------------------------------------------------------------------------
+
+Connection::Connection(const int fd, const size_t max_line, const uint32_t generation)
+    : _socket(fd)
+    , _inbound(max_line)
+    , _outbound()
+    , _rooms()
+    , _nickname()
+    , _catchup{0, 0, 0}
+    , _timers{TimerWheel::NONE, TimerWheel::NONE, TimerWheel::NONE, TimerWheel::NONE, 0, 0}
+    , _heartbeat{0, 0, 0, 0}
+    , _throttle{0.0, 0.0, 0, false}
+    , _connected_at(0)
+    , _generation(generation)
+    , _writing(false)
+    , _pending(false)
+    , _backlogged(false)
+    , _closing(false)
+{
+}
+
+// ---------------------------------------------------------------------------
+// ConnectionTable
+// ---------------------------------------------------------------------------
+
+Connection& ConnectionTable::insert(const int fd, const size_t max_line)
+{
+    if(static_cast<size_t>(fd) >= _slots.size()) {
+        _slots.resize(fd + 1, Slot{-1, 0});
+    }
+    Slot& slot(_slots[fd]);
+    if(slot.index >= 0) {
+        throw std::runtime_error("connection is already registered");
+    }
+    /* a new generation tells apart connections reusing the same descriptor */
+    _connections.emplace_back(fd, max_line, ++slot.generation);
+    slot.index = _connections.size() - 1;
+    return _connections.back();
+}
+
+void ConnectionTable::erase(const int fd)
+{
+    if((fd < 0) || (static_cast<size_t>(fd) >= _slots.size())) {
+        return;
+    }
+    Slot& slot(_slots[fd]);
+    if(slot.index < 0) {
+        return;
+    }
+    /* swap-remove keeps the connections contiguous */
+    const size_t index = slot.index;
+    if(index != _connections.size() - 1) {
+        _connections[index] = std::move(_connections.back());
+        _slots[_connections[index].fd()].index = index;
+    }
+    _connections.pop_back();
+    slot.index = -1;
+}
+
+void ConnectionTable::clear()
+{
+    for(auto& connection : _connections) {
+        _slots[connection.fd()].index = -1;
+    }
+    _connections.clear();
+}
+
+// ---------------------------------------------------------------------------
+// RoomTable
+// ---------------------------------------------------------------------------
+
+void RoomTable::join(const uint32_t room, const ConnectionHandle& handle)
+{
+    _rooms[room].push_back(handle);
+}
+
+void RoomTable::leave(const uint32_t room, const ConnectionHandle& handle)
+{
+    auto it = _rooms.find(room);
+    if(it == _rooms.end()) {
+        return;
+    }
+    /* subscriber order does not matter, swap with the last one */
+    Subscribers& subscribers(it->second);
+    for(auto& subscriber : subscribers) {
+        if((subscriber.fd == handle.fd) && (subscriber.generation == handle.generation)) {
+            subscriber = subscribers.back();
+            subscribers.pop_back();
+            break;
+        }
+    }
+    if(subscribers.empty()) {
+        _rooms.erase(it);
+    }
+}
+
+void RoomTable::clear()
+{
+    _rooms.clear();
+}
+
+// ---------------------------------------------------------------------------
+// TimerWheel
+// ---------------------------------------------------------------------------
+
+TimerWheel::TimerWheel(const uint64_t tick, const uint64_t now)
+    : _tick(std::max<uint64_t>(tick, 1))
+    , _current(now / _tick)
+    , _active(0)
+    , _nodes()
+    , _free()
+    , _heads(LEVELS * SLOTS, NONE)
+    , _occupied()
+{
+    for(auto& occupied : _occupied) {
+        occupied = 0;
+    }
+}
+
+uint32_t TimerWheel::arm(const uint64_t deadline, const uint64_t data)
+{
+    uint32_t timer = NONE;
+    if(_free.empty()) {
+        timer = _nodes.size();
+        _nodes.push_back(Node());
+    }
+    else {
+        timer = _free.back();
+        _free.pop_back();
+    }
+    Node& node(_nodes[timer]);
+    node.expiry = std::max(deadline / _tick, _current + 1);
+    node.data   = data;
+    node.armed  = true;
+    link(timer);
+    ++_active;
+    return timer;
+}
+
+void TimerWheel::rearm(const uint32_t timer, const uint64_t deadline)
+{
+    unlink(timer);
+    _nodes[timer].expiry = std::max(deadline / _tick, _current + 1);
+    link(timer);
+}
+
+void TimerWheel::cancel(const uint32_t timer)
+{
+    if((timer == NONE) || !_nodes[timer].armed) {
+        return;
+    }
+    unlink(timer);
+    _nodes[timer].armed = false;
+    _free.push_back(timer);
+    --_active;
+}
+
+int TimerWheel::timeout(const uint64_t now) const
+{
+    /*
+     * the next non-empty slot of the first level is an exact deadline, the upper
+     * levels only need the wheel to be turned when the lowest of them cascades
+     */
+    if(_active == 0) {
+        return -1;
+    }
+    uint64_t next = UINT64_MAX;
+    if(_occupied[0] != 0) {
+        const unsigned offset = (_current + 1) & (SLOTS - 1);
+        const uint64_t rotated = (_occupied[0] >> offset) | (offset != 0 ? (_occupied[0] << (SLOTS - offset)) : 0);
+        next = _current + 1 + __builtin_ctzll(rotated);
+    }
+    for(unsigned level = 1; level < LEVELS; ++level) {
+        if(_occupied[level] != 0) {
+            const uint64_t span = static_cast<uint64_t>(1) << (LEVEL_BITS * level);
+            next = std::min(next, ((_current / span) + 1) * span);
+            break;
+        }
+    }
+    const uint64_t deadline = next * _tick;
+    if(deadline <= now) {
+        return 0;
+    }
+    return static_cast<int>(std::min<uint64_t>(deadline - now, INT_MAX));
+}
+
+void TimerWheel::expire(const uint64_t now, std::vector<uint64_t>& expired)
+{
+    const uint64_t target = now / _tick;
+    while(_current < target) {
+        /* stretches where the lower levels are empty are skipped up to the next cascade */
+        unsigned empty = 0;
+        while((empty < LEVELS) && (_occupied[empty] == 0)) {
+            ++empty;
+        }
+        if(empty == LEVELS) {
+            _current = target;
+            break;
+        }
+        if(empty > 0) {
+            const uint64_t span = static_cast<uint64_t>(1) << (LEVEL_BITS * empty);
+            _current = std::min(target, (((_current / span) + 1) * span) - 1);
+            if(_current == target) {
+                break;
+            }
+        }
+        ++_current;
+        for(unsigned level = LEVELS - 1; level > 0; --level) {
+            const uint64_t span = static_cast<uint64_t>(1) << (LEVEL_BITS * level);
+            if((_current % span) == 0) {
+                cascade(level);
+            }
+        }
+        const unsigned slot = _current & (SLOTS - 1);
+        while(_heads[slot] != NONE) {
+            const uint32_t timer = _heads[slot];
+            expired.push_back(_nodes[timer].data);
+            cancel(timer);
+        }
+    }
+}
+
+void TimerWheel::link(const uint32_t timer)
+{
+    /* a distant deadline waits in the last level until it cascades */
+    Node& node(_nodes[timer]);
+    const uint64_t delta = node.expiry - _current;
+    unsigned level = 0;
+    while((level < (LEVELS - 1)) && (delta >= (static_cast<uint64_t>(1) << (LEVEL_BITS * (level + 1))))) {
+        ++level;
+    }
+    const uint64_t capped = std::min(node.expiry, _current + (static_cast<uint64_t>(1) << (LEVEL_BITS * LEVELS)) - 1);
+    const unsigned index  = (capped >> (LEVEL_BITS * level)) & (SLOTS - 1);
+    const unsigned slot   = (level * SLOTS) + index;
+    node.slot = slot;
+    node.prev = NONE;
+    node.next = _heads[slot];
+    if(node.next != NONE) {
+        _nodes[node.next].prev = timer;
+    }
+    _heads[slot] = timer;
+    _occupied[level] |= (static_cast<uint64_t>(1) << index);
+}
+
+void TimerWheel::unlink(const uint32_t timer)
+{
+    Node& node(_nodes[timer]);
+    if(node.prev != NONE) {
+        _nodes[node.prev].next = node.next;
+    }
+    else {
+        _heads[node.slot] = node.next;
+    }
+    if(node.next != NONE) {
+        _nodes[node.next].prev = node.prev;
+    }
+    if(_heads[node.slot] == NONE) {
+        _occupied[node.slot / SLOTS] &= ~(static_cast<uint64_t>(1) << (node.slot & (SLOTS - 1)));
+    }
+}
+
+void TimerWheel::cascade(const unsigned level)
+{
+    /* the timers of the slot that just came due are spread over the lower levels */
+    const unsigned slot = (level * SLOTS) + ((_current >> (LEVEL_BITS * level)) & (SLOTS - 1));
+    uint32_t timer = _heads[slot];
+    _heads[slot] = NONE;
+    _occupied[level] &= ~(static_cast<uint64_t>(1) << (slot & (SLOTS - 1)));
+    while(timer != NONE) {
+        const uint32_t next = _nodes[timer].next;
+        link(timer);
+        timer = next;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Histogram
+// ---------------------------------------------------------------------------
+
+Histogram::Histogram()
+    : _buckets()
+    , _count(0)
+    , _sum(0)
+{
+    for(auto& bucket : _buckets) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+}
+
+void Histogram::record(const uint64_t value)
+{
+    /* like the counters, a histogram has a single writer */
+    std::atomic<uint64_t>& slot(_buckets[bucket(value)]);
+    slot.store(slot.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    _count.store(_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    _sum.store(_sum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+void Histogram::merge(const Histogram& other)
+{
+    for(unsigned index = 0; index < BUCKETS; ++index) {
+        _buckets[index].fetch_add(other._buckets[index].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    _count.fetch_add(other.count(), std::memory_order_relaxed);
+    _sum.fetch_add(other.sum(), std::memory_order_relaxed);
+}
+
+uint64_t Histogram::percentile(const double quantile) const
+{
+    uint64_t total = 0;
+    for(const auto& bucket : _buckets) {
+        total += bucket.load(std::memory_order_relaxed);
+    }
+    if(total == 0) {
+        return 0;
+    }
+    const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(quantile * total + 0.5));
+    uint64_t seen = 0;
+    for(unsigned index = 0; index < BUCKETS; ++index) {
+        seen += _buckets[index].load(std::memory_order_relaxed);
+        if(seen >= rank) {
+            return highest(index);
+        }
+    }
+    return highest(BUCKETS - 1);
+}
+
+unsigned Histogram::bucket(const uint64_t value)
+{
+    /* exact below 2^SUB_BITS, then 2^SUB_BITS linear sub-buckets per power of two */
+    if(value < (1U << SUB_BITS)) {
+        return value;
+    }
+    const unsigned exponent = 63 - __builtin_clzll(value);
+    const unsigned shift    = exponent - SUB_BITS;
+    return ((shift + 1) << SUB_BITS) + ((value >> shift) & ((1U << SUB_BITS) - 1));
+}
+
+uint64_t Histogram::highest(const unsigned bucket)
+{
+    if(bucket < (1U << SUB_BITS)) {
+        return bucket;
+    }
+    const unsigned shift = (bucket >> SUB_BITS) - 1;
+    const uint64_t lower = static_cast<uint64_t>((1U << SUB_BITS) + (bucket & ((1U << SUB_BITS) - 1))) << shift;
+    return lower + ((static_cast<uint64_t>(1) << shift) - 1);
+}
+
+// ---------------------------------------------------------------------------
+// Metrics
+// ---------------------------------------------------------------------------
+
+Metrics::Metrics()
+    : _counters()
+    , _latency()
+    , _rtt()
+{
+    for(auto& counter : _counters) {
+        counter.value.store(0, std::memory_order_relaxed);
+    }
+}
+
+const char* Metrics::name(const Counter counter)
+{
+    switch(counter) {
+        case ACCEPTS:
+            return "accepts";
+        case DISCONNECTS:
+            return "disconnects";
+        case BYTES_IN:
+            return "bytes_in";
+        case BYTES_OUT:
+            return "bytes_out";
+        case MESSAGES_IN:
+            return "messages_in";
+        case MESSAGES_OUT:
+            return "messages_out";
+        case SEND_CALLS:
+            return "send_calls";
+        case QUEUE_DROPS:
+            return "queue_drops";
+        case REJECTS:
+            return "rejects";
+        case THROTTLES:
+            return "throttles";
+        case PINGS:
+            return "pings";
+        case PONGS:
+            return "pongs";
+        default:
+            break;
+    }
+    return "unknown";
+}
+
+uint64_t Metrics::now()
+{
+    timespec now = {};
+    static_cast<void>(::clock_gettime(CLOCK_MONOTONIC, &now));
+    return (static_cast<uint64_t>(now.tv_sec) * 1000000000UL) + static_cast<uint64_t>(now.tv_nsec);
+}
+
+// ---------------------------------------------------------------------------
+// EventListener
+// ---------------------------------------------------------------------------
+
+void EventListener::onReadable(const int fd)
+{
+}
+
+void EventListener::onWritable(const int fd)
+{
+}
+
+void EventListener::onAccepted(const int fd, const int client_fd)
+{
+}
+
+void EventListener::onReceived(const int fd, const char* data, const size_t size)
+{
+}
+
+void EventListener::onSent(const int fd, const ssize_t result)
+{
+}
+
+// ---------------------------------------------------------------------------
+// EventLoop
+// ---------------------------------------------------------------------------
+
+EventLoop::EventLoop(EventListener& listener)
+    : _listener(listener)
+    , _listeners()
+{
+}
+
+void EventLoop::add(const int fd, const unsigned events, EventListener& listener)
+{
+    doAdd(fd, events);
+    attach(fd, listener);
+}
+
+void EventLoop::modify(const int fd, const unsigned events)
+{
+    doModify(fd, events);
+}
+
+void EventLoop::remove(const int fd)
+{
+    doRemove(fd);
+    if(static_cast<size_t>(fd) < _listeners.size()) {
+        _listeners[fd] = nullptr;
+    }
+}
+
+void EventLoop::accept(const int fd)
+{
+    doAccept(fd);
+    attach(fd, _listener);
+}
+
+void EventLoop::receive(const int fd)
+{
+    doReceive(fd);
+    attach(fd, _listener);
+}
+
+bool EventLoop::completions() const
+{
+    return false;
+}
+
+size_t EventLoop::send(const int fd, const MessageQueue& queue, const size_t limit)
+{
+    throw std::runtime_error("send() is not supported by this backend");
+}
+
+void EventLoop::doAccept(const int fd)
+{
+    throw std::runtime_error("accept() is not supported by this backend");
+}
+
+void EventLoop::doReceive(const int fd)
+{
+    throw std::runtime_error("receive() is not supported by this backend");
+}
+
+void EventLoop::attach(const int fd, EventListener& listener)
+{
+    if(static_cast<size_t>(fd) >= _listeners.size()) {
+        _listeners.resize(fd + 1, nullptr);
+    }
+    _listeners[fd] = &listener;
+}
+
+void EventLoop::notifyReadable(const int fd)
+{
+    /* events may still be pending for a descriptor removed by a previous callback */
+    if(static_cast<size_t>(fd) < _listeners.size()) {
+        EventListener* listener = _listeners[fd];
+        if(listener != nullptr) {
+            listener->onReadable(fd);
+        }
+    }
+}
+
+void EventLoop::notifyWritable(const int fd)
+{
+    if(static_cast<size_t>(fd) < _listeners.size()) {
+        EventListener* listener = _listeners[fd];
+        if(listener != nullptr) {
+            listener->onWritable(fd);
+        }
+    }
+}
+
+void EventLoop::notifyAccepted(const int fd, const int client_fd)
+{
+    if(static_cast<size_t>(fd) < _listeners.size()) {
+        EventListener* listener = _listeners[fd];
+        if(listener != nullptr) {
+            listener->onAccepted(fd, client_fd);
+            return;
+        }
+    }
+    /* nobody is left to own the accepted descriptor */
+    static_cast<void>(::close(client_fd));
+}
+
+void EventLoop::notifyReceived(const int fd, const char* data, const size_t size)
+{
+    if(static_cast<size_t>(fd) < _listeners.size()) {
+        EventListener* listener = _listeners[fd];
+        if(listener != nullptr) {
+            listener->onReceived(fd, data, size);
+        }
+    }
+}
+
+void EventLoop::notifySent(const int fd, const ssize_t result)
+{
+    if(static_cast<size_t>(fd) < _listeners.size()) {
+        EventListener* listener = _listeners[fd];
+        if(listener != nullptr) {
+            listener->onSent(fd, result);
+        }
+    }
+}
+
+auto EventLoop::create(const std::string& backend, EventListener& listener) -> std::unique_ptr<EventLoop>
+{
+    if(backend == "epoll") {
+        return std::unique_ptr<EventLoop>(new EpollEventLoop(listener));
+    }
+    if(backend == "poll") {
+        return std::unique_ptr<EventLoop>(new PollEventLoop(listener));
+    }
+    if(backend == "io_uring") {
+#ifdef HAVE_IO_URING
+        try {
+            return std::unique_ptr<EventLoop>(new UringEventLoop(listener));
+        }
+        catch(const std::exception& e) {
+            Logger::log(Logger::WARN, "io_uring is unavailable, falling back to epoll: ", 0, 0, e.what());
+        }
+#else
+        Logger::log(Logger::WARN, "io_uring support is not compiled in, falling back to epoll", 0, 0);
+#endif
+        return std::unique_ptr<EventLoop>(new EpollEventLoop(listener));
+    }
+    throw std::runtime_error("unknown event loop backend");
+}
+
+// ---------------------------------------------------------------------------
+// PollEventLoop
+// ---------------------------------------------------------------------------
+
+namespace {
+
+short to_poll_events(const unsigned events)
+{
+    short result = 0;
+
+    if(events & EventLoop::EV_READ) {
+        result |= POLLIN;
+    }
+    if(events & EventLoop::EV_WRITE) {
+        result |= POLLOUT;
+    }
+    return result;
+}
+
+}
+
+PollEventLoop::PollEventLoop(EventListener& listener)
+    : EventLoop(listener)
+    , _pollfds()
+    , _ready()
+{
+}
+
+const char* PollEventLoop::name() const
+{
+    return "poll";
+}
+
+void PollEventLoop::doAdd(const int fd, const unsigned events)
+{
+    _pollfds.push_back({fd, to_poll_events(events), 0});
+}
+
+void PollEventLoop::doModify(const int fd, const unsigned events)
+{
+    for(auto& pollfd : _pollfds) {
+        if(pollfd.fd == fd) {
+            pollfd.events = to_poll_events(events);
+            break;
+        }
+    }
+}
+
+void PollEventLoop::doRemove(const int fd)
+{
+    for(auto it = _pollfds.begin(); it != _pollfds.end(); ++it) {
+        if(it->fd == fd) {
+            *it = _pollfds.back();
+            _pollfds.pop_back();
+            break;
+        }
+    }
+}
+
+int PollEventLoop::wait(const int timeout)
+{
+    const int rc = ::poll(_pollfds.data(), _pollfds.size(), timeout);
+    if(rc < 0) {
+        if(errno == EINTR) {
+            return 0;
+        }
+        throw std::runtime_error("poll() has failed");
+    }
+    /* callbacks may add or remove descriptors, so dispatch from a snapshot */
+    _ready.clear();
+    for(const auto& pollfd : _pollfds) {
+        if(pollfd.revents != 0) {
+            _ready.push_back(pollfd);
+        }
+    }
+    for(const auto& pollfd : _ready) {
+        if(pollfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            notifyReadable(pollfd.fd);
+        }
+        if(pollfd.revents & POLLOUT) {
+            notifyWritable(pollfd.fd);
+        }
+    }
+    return rc;
+}
+
+// ---------------------------------------------------------------------------
+// EpollEventLoop
+// ---------------------------------------------------------------------------
+
+namespace {
+
+uint32_t to_epoll_events(const unsigned events)
+{
+    uint32_t result = 0;
+
+    if(events & EventLoop::EV_READ) {
+        result |= EPOLLIN | EPOLLRDHUP;
+    }
+    if(events & EventLoop::EV_WRITE) {
+        result |= EPOLLOUT;
+    }
+    if(events & EventLoop::EV_EDGE) {
+        result |= EPOLLET;
+    }
+    return result;
+}
+
+}
+
+EpollEventLoop::EpollEventLoop(EventListener& listener)
+    : EventLoop(listener)
+    , _epfd(-1)
+    , _events()
+{
+    _epfd = ::epoll_create1(EPOLL_CLOEXEC);
+    if(_epfd < 0) {
+        throw std::runtime_error("epoll_create1() has failed");
+    }
+}
+
+EpollEventLoop::~EpollEventLoop()
+{
+    if(_epfd >= 0) {
+        _epfd = (::close(_epfd), -1);
+    }
+}
+
+const char* EpollEventLoop::name() const
+{
+    return "epoll";
+}
+
+void EpollEventLoop::doAdd(const int fd, const unsigned events)
+{
+    epoll_event event = {};
+    event.events  = to_epoll_events(events);
+    event.data.fd = fd;
+
+    const int rc = ::epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &event);
+    if(rc < 0) {
+        throw std::runtime_error("epoll_ctl() has failed");
+    }
+}
+
+void EpollEventLoop::doModify(const int fd, const unsigned events)
+{
+    epoll_event event = {};
+    event.events  = to_epoll_events(events);
+    event.data.fd = fd;
+
+    const int rc = ::epoll_ctl(_epfd, EPOLL_CTL_MOD, fd, &event);
+    if(rc < 0) {
+        throw std::runtime_error("epoll_ctl() has failed");
+    }
+}
+
+void EpollEventLoop::doRemove(const int fd)
+{
+    const int rc = ::epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, nullptr);
+    if(rc < 0) {
+        /* the descriptor may already be closed, and thus already forgotten */
+        if((errno == EBADF) || (errno == ENOENT)) {
+            return;
+        }
+        throw std::runtime_error("epoll_ctl() has failed");
+    }
+}
+
+int EpollEventLoop::wait(const int timeout)
+{
+    const int rc = ::epoll_wait(_epfd, _events.data(), _events.size(), timeout);
+    if(rc < 0) {
+        if(errno == EINTR) {
+            return 0;
+        }
+        throw std::runtime_error("epoll_wait() has failed");
+    }
+    for(int index = 0; index < rc; ++index) {
+        const epoll_event& event(_events[index]);
+        if(event.events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            notifyReadable(event.data.fd);
+        }
+        if(event.events & EPOLLOUT) {
+            notifyWritable(event.data.fd);
+        }
+    }
+    return rc;
+}
+
+// ---------------------------------------------------------------------------
+// UringEventLoop
+// ---------------------------------------------------------------------------
+
+#ifdef HAVE_IO_URING
+
+namespace {
+
+constexpr unsigned uring_entries      = 4096;
+constexpr unsigned uring_buffer_count = 16;
+constexpr unsigned uring_buffer_size  = 4096;
+constexpr uint16_t uring_buffer_group = 0;
+constexpr int      uring_batch        = 256;
+constexpr int      uring_probe_wait   = 1000;
+
+/* a timeout request reads its timespec when submitted, these outlive any submission */
+const __kernel_timespec uring_retry_soon  = {0, 1000000L};
+const __kernel_timespec uring_retry_later = {0, 100000000L};
+
+enum UringRetry
+{
+    URING_RETRY_NOW,
+    URING_RETRY_LATER,
+    URING_RETRY_NEVER,
+};
+
+/* how an accept that ended without IORING_CQE_F_MORE is resumed */
+UringRetry uring_accept_retry(const int result)
+{
+    if(result >= 0) {
+        return URING_RETRY_NOW;
+    }
+    switch(-result) {
+        case EINTR:
+        case EAGAIN:
+        case ECONNABORTED:
+        case EPROTO:
+        case EPERM:
+        case ENETDOWN:
+        case ENETUNREACH:
+        case EHOSTDOWN:
+        case EHOSTUNREACH:
+        case ENOPROTOOPT:
+        case EOPNOTSUPP:
+        case ETIMEDOUT:
+            return URING_RETRY_NOW;
+        case EMFILE:
+        case ENFILE:
+        case ENOBUFS:
+        case ENOMEM:
+            return URING_RETRY_LATER;
+        default:
+            return URING_RETRY_NEVER;
+    }
+}
+
+int uring_setup(const unsigned entries, io_uring_params* params)
+{
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+int uring_enter(const int fd, const unsigned to_submit, const unsigned min_complete, const unsigned flags, const void* arg, const size_t size)
+{
+    return static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, size));
+}
+
+/* user_data layout: kind (8 bits) | generation (24 bits) | fd or request index (32 bits) */
+uint64_t uring_encode(const uint64_t kind, const uint32_t generation, const uint32_t index)
+{
+    return (kind << 56) | (static_cast<uint64_t>(generation & 0xffffff) << 32) | index;
+}
+
+}
+
+UringEventLoop::UringEventLoop(EventListener& listener)
+    : EventLoop(listener)
+    , _ring_fd(-1)
+    , _ring_ptr(nullptr)
+    , _ring_size(0)
+    , _sqes(nullptr)
+    , _sqes_size(0)
+    , _sq_head(nullptr)
+    , _sq_tail(nullptr)
+    , _sq_mask(0)
+    , _sq_entries(0)
+    , _sq_local_tail(0)
+    , _to_submit(0)
+    , _cq_head(nullptr)
+    , _cq_tail(nullptr)
+    , _cq_mask(0)
+    , _cqes(nullptr)
+    , _buffers(nullptr)
+    , _slots()
+    , _requests()
+    , _free_requests()
+{
+    try {
+        io_uring_params params = {};
+        _ring_fd = uring_setup(uring_entries, &params);
+        if(_ring_fd < 0) {
+            throw std::runtime_error("io_uring_setup() has failed");
+        }
+        const unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+        if((params.features & required) != required) {
+            throw std::runtime_error("io_uring is not supported by this kernel");
+        }
+        /* the submission and completion rings share a single mapping */
+        _ring_size = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned)
+                            , params.cq_off.cqes  + params.cq_entries * sizeof(io_uring_cqe));
+        void* ring = ::mmap(nullptr, _ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQ_RING);
+        if(ring == MAP_FAILED) {
+            throw std::runtime_error("mmap() has failed");
+        }
+        _ring_ptr = ring;
+        _sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqes = ::mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQES);
+        if(sqes == MAP_FAILED) {
+            throw std::runtime_error("mmap() has failed");
+        }
+        _sqes = static_cast<io_uring_sqe*>(sqes);
+        char* base = static_cast<char*>(_ring_ptr);
+        _sq_head       = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+        _sq_tail       = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+        _sq_mask       = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+        _sq_entries    = params.sq_entries;
+        _sq_local_tail = *_sq_tail;
+        _cq_head       = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+        _cq_tail       = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+        _cq_mask       = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+        _cqes          = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+        /* submission entries are always consumed in order, so the indirection array is the identity */
+        unsigned* array = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+        for(unsigned index = 0; index < _sq_entries; ++index) {
+            array[index] = index;
+        }
+        /* provided buffers let multishot receives pick their memory only when data arrives */
+        void* buffers = ::mmap(nullptr, uring_buffer_count * uring_buffer_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(buffers == MAP_FAILED) {
+            throw std::runtime_error("mmap() has failed");
+        }
+        _buffers = static_cast<char*>(buffers);
+        io_uring_sqe* sqe = acquire();
+        sqe->opcode    = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd        = uring_buffer_count;
+        sqe->addr      = reinterpret_cast<uint64_t>(_buffers);
+        sqe->len       = uring_buffer_size;
+        sqe->off       = 0;
+        sqe->buf_group = uring_buffer_group;
+        sqe->user_data = uring_encode(KIND_BUFFER, 0, 0);
+        probe();
+    }
+    catch(...) {
+        release();
+        throw;
+    }
+}
+
+UringEventLoop::~UringEventLoop()
+{
+    release();
+}
+
+const char* UringEventLoop::name() const
+{
+    return "io_uring";
+}
+
+bool UringEventLoop::completions() const
+{
+    return true;
+}
+
+size_t UringEventLoop::send(const int fd, const MessageQueue& queue, const size_t limit)
+{
+    io_uring_sqe* sqe = acquire();
+    uint32_t index = 0;
+    if(_free_requests.empty()) {
+        index = _requests.size();
+        _requests.emplace_back(new SendRequest());
+    }
+    else {
+        index = _free_requests.back();
+        _free_requests.pop_back();
+    }
+    /* the request pins the gathered messages until the kernel is done with them */
+    SendRequest& request(*_requests[index]);
+    Slot&        entry(slot(fd));
+    request.fd         = fd;
+    request.generation = entry.generation;
+    request.iovecs.resize(std::min({queue.size(), limit, static_cast<size_t>(IOV_MAX)}));
+    const size_t count = queue.gather(request.iovecs.data(), request.iovecs.size());
+    for(size_t position = 0; position < count; ++position) {
+        request.pinned.push_back(queue.at(position));
+    }
+    request.message            = msghdr();
+    request.message.msg_iov    = request.iovecs.data();
+    request.message.msg_iovlen = count;
+    sqe->opcode    = IORING_OP_SENDMSG;
+    sqe->fd        = fd;
+    sqe->addr      = reinterpret_cast<uint64_t>(&request.message);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = uring_encode(KIND_SEND, entry.generation, index);
+    entry.request  = index;
+    return count;
+}
+
+int UringEventLoop::wait(const int timeout)
+{
+    /* queued requests are submitted and completions awaited with a single system call */
+    const bool     ready        = (__atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE) != *_cq_head);
+    const unsigned min_complete = ((ready || (timeout == 0)) ? 0 : 1);
+    if((_to_submit > 0) || (min_complete > 0)) {
+        static_cast<void>(enter(min_complete, timeout));
+    }
+    /*
+     * callbacks may queue new requests, they are submitted by the next wait;
+     * completions beyond the batch are left for the next wait, which then
+     * does not block, so queued output gets flushed in between
+     */
+    int      count = 0;
+    unsigned head  = *_cq_head;
+    while((count < uring_batch) && (head != __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE))) {
+        const io_uring_cqe cqe(_cqes[head & _cq_mask]);
+        __atomic_store_n(_cq_head, ++head, __ATOMIC_RELEASE);
+        complete(cqe);
+        ++count;
+    }
+    return count;
+}
+
+void UringEventLoop::doAdd(const int fd, const unsigned events)
+{
+    Slot& entry(slot(fd));
+    entry.kind   = KIND_POLL;
+    entry.events = events;
+    arm(fd);
+}
+
+void UringEventLoop::doModify(const int fd, const unsigned events)
+{
+    Slot& entry(slot(fd));
+    if(entry.kind == KIND_RECV) {
+        /* a receiving descriptor only asks to be told once when it becomes writable */
+        if((events & EV_WRITE) && !(entry.events & EV_WRITE)) {
+            io_uring_sqe* sqe = acquire();
+            sqe->opcode        = IORING_OP_POLL_ADD;
+            sqe->fd            = fd;
+            sqe->poll32_events = POLLOUT;
+            sqe->user_data     = uring_encode(KIND_WRITE, entry.generation, fd);
+            entry.events |= EV_WRITE;
+        }
+        /* without EV_READ the multishot receive is cancelled, it is armed again with it */
+        const bool paused = ((events & EV_READ) == 0);
+        if(paused != entry.paused) {
+            entry.paused = paused;
+            if(paused && entry.receiving) {
+                cancel(uring_encode(KIND_RECV, entry.generation, fd));
+            }
+            else if(!paused && !entry.receiving) {
+                arm(fd);
+            }
+        }
+        return;
+    }
+    cancel(uring_encode(KIND_POLL, entry.generation, fd));
+    ++entry.generation;
+    entry.events = events;
+    arm(fd);
+}
+
+void UringEventLoop::doRemove(const int fd)
+{
+    Slot& entry(slot(fd));
+    if(entry.kind != KIND_NONE) {
+        cancel(uring_encode(entry.kind, entry.generation, fd));
+    }
+    if(entry.request >= 0) {
+        cancel(uring_encode(KIND_SEND, entry.generation, entry.request));
+    }
+    if((entry.kind == KIND_RECV) && (entry.events & EV_WRITE)) {
+        cancel(uring_encode(KIND_WRITE, entry.generation, fd));
+    }
+    /* late completions of the previous owner are recognized by their generation */
+    ++entry.generation;
+    entry.kind      = KIND_NONE;
+    entry.events    = 0;
+    entry.request   = -1;
+    entry.receiving = false;
+    entry.paused    = false;
+}
+
+void UringEventLoop::doAccept(const int fd)
+{
+    Slot& entry(slot(fd));
+    entry.kind = KIND_ACCEPT;
+    arm(fd);
+}
+
+void UringEventLoop::doReceive(const int fd)
+{
+    Slot& entry(slot(fd));
+    entry.kind    = KIND_RECV;
+    entry.request = -1;
+    arm(fd);
+}
+
+void UringEventLoop::release()
+{
+    if(_ring_fd >= 0) {
+        _ring_fd = (::close(_ring_fd), -1);
+    }
+    if(_buffers != nullptr) {
+        _buffers = (::munmap(_buffers, uring_buffer_count * uring_buffer_size), nullptr);
+    }
+    if(_sqes != nullptr) {
+        _sqes = (::munmap(_sqes, _sqes_size), nullptr);
+    }
+    if(_ring_ptr != nullptr) {
+        _ring_ptr = (::munmap(_ring_ptr, _ring_size), nullptr);
+    }
+}
+
+void UringEventLoop::probe()
+{
+    /*
+     * kernels before 6.0 either reject multishot accept and receive or run them
+     * only once, so both are tried on a connected pair of sockets; when one does
+     * not keep going, the constructor fails and the factory falls back to epoll
+     */
+    const int   server    = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    const int   client    = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int         peer      = -1;
+    bool        accepting = false;
+    bool        receiving = false;
+    bool        supported = false;
+    sockaddr_un address   = {};
+    socklen_t   size      = sizeof(address.sun_family);
+    io_uring_cqe cqe      = {};
+    address.sun_family = AF_UNIX;
+    /* an unnamed address is auto-bound to a unique abstract name */
+    if((server >= 0) && (client >= 0)
+    && (::bind(server, reinterpret_cast<sockaddr*>(&address), size) == 0)
+    && (::listen(server, 1) == 0)
+    && ((size = sizeof(address)), (::getsockname(server, reinterpret_cast<sockaddr*>(&address), &size) == 0))
+    && (::connect(client, reinterpret_cast<sockaddr*>(&address), size) == 0)
+    && (::send(client, "?", 1, MSG_NOSIGNAL) == 1)) {
+        io_uring_sqe* sqe = acquire();
+        sqe->opcode       = IORING_OP_ACCEPT;
+        sqe->fd           = server;
+        sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data    = uring_encode(KIND_ACCEPT, 0, server);
+        if(await(uring_encode(KIND_ACCEPT, 0, server), cqe) && (cqe.res >= 0)) {
+            peer      = cqe.res;
+            accepting = ((cqe.flags & IORING_CQE_F_MORE) != 0);
+        }
+    }
+    if(accepting) {
+        io_uring_sqe* sqe = acquire();
+        sqe->opcode    = IORING_OP_RECV;
+        sqe->fd        = peer;
+        sqe->ioprio    = IORING_RECV_MULTISHOT;
+        sqe->flags     = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = uring_buffer_group;
+        sqe->user_data = uring_encode(KIND_RECV, 0, peer);
+        if(await(uring_encode(KIND_RECV, 0, peer), cqe)) {
+            receiving = ((cqe.flags & IORING_CQE_F_MORE) != 0);
+            supported = (receiving && (cqe.res == 1));
+            if(cqe.flags & IORING_CQE_F_BUFFER) {
+                recycle(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+        }
+    }
+    /* requests still running are cancelled and waited for, their descriptors are about to be reused */
+    if(accepting) {
+        cancel(uring_encode(KIND_ACCEPT, 0, server));
+        while(accepting && await(uring_encode(KIND_ACCEPT, 0, server), cqe)) {
+            if(cqe.res >= 0) {
+                static_cast<void>(::close(cqe.res));
+            }
+            accepting = ((cqe.flags & IORING_CQE_F_MORE) != 0);
+        }
+    }
+    if(receiving) {
+        cancel(uring_encode(KIND_RECV, 0, peer));
+        while(receiving && await(uring_encode(KIND_RECV, 0, peer), cqe)) {
+            if(cqe.flags & IORING_CQE_F_BUFFER) {
+                recycle(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+            receiving = ((cqe.flags & IORING_CQE_F_MORE) != 0);
+        }
+    }
+    for(const int fd : {peer, client, server}) {
+        if(fd >= 0) {
+            static_cast<void>(::close(fd));
+        }
+    }
+    if(accepting || receiving) {
+        throw std::runtime_error("io_uring probe requests did not complete");
+    }
+    if(!supported) {
+        throw std::runtime_error("io_uring multishot accept and receive are not supported by this kernel");
+    }
+}
+
+bool UringEventLoop::await(const uint64_t user_data, io_uring_cqe& result)
+{
+    /* other completions seen meanwhile, buffer and cancel requests, carry nothing to dispatch */
+    const uint64_t deadline = Metrics::now() + (uring_probe_wait * 1000000ULL);
+    while(true) {
+        unsigned head = *_cq_head;
+        while(head != __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE)) {
+            const io_uring_cqe cqe(_cqes[head & _cq_mask]);
+            __atomic_store_n(_cq_head, ++head, __ATOMIC_RELEASE);
+            if(cqe.user_data == user_data) {
+                result = cqe;
+                return true;
+            }
+        }
+        if(Metrics::now() >= deadline) {
+            return false;
+        }
+        static_cast<void>(enter(1, 10));
+    }
+}
+
+auto UringEventLoop::slot(const int fd) -> Slot&
+{
+    if(static_cast<size_t>(fd) >= _slots.size()) {
+        _slots.resize(fd + 1, Slot{0, KIND_NONE, 0, -1, false, false});
+    }
+    return _slots[fd];
+}
+
+bool UringEventLoop::current(const int fd, const uint32_t generation) const
+{
+    if(static_cast<size_t>(fd) < _slots.size()) {
+        return (_slots[fd].generation & 0xffffff) == generation;
+    }
+    return false;
+}
+
+auto UringEventLoop::acquire() -> io_uring_sqe*
+{
+    if((_sq_local_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE)) >= _sq_entries) {
+        static_cast<void>(enter(0, 0));
+        if((_sq_local_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE)) >= _sq_entries) {
+            throw std::runtime_error("io_uring submission queue is full");
+        }
+    }
+    io_uring_sqe* sqe = &_sqes[_sq_local_tail & _sq_mask];
+    ::memset(sqe, 0, sizeof(*sqe));
+    ++_sq_local_tail;
+    ++_to_submit;
+    return sqe;
+}
+
+int UringEventLoop::enter(const unsigned min_complete, const int timeout)
+{
+    __atomic_store_n(_sq_tail, _sq_local_tail, __ATOMIC_RELEASE);
+
+    unsigned               flags = IORING_ENTER_EXT_ARG;
+    __kernel_timespec      ts    = {};
+    io_uring_getevents_arg arg   = {};
+    if(min_complete > 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if(timeout > 0) {
+            ts.tv_sec  = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000L;
+            arg.ts     = reinterpret_cast<uint64_t>(&ts);
+        }
+    }
+    const int rc = uring_enter(_ring_fd, _to_submit, min_complete, flags, &arg, sizeof(arg));
+    _to_submit = _sq_local_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+    if(rc < 0) {
+        if((errno == EINTR) || (errno == ETIME) || (errno == EAGAIN) || (errno == EBUSY)) {
+            return 0;
+        }
+        throw std::runtime_error("io_uring_enter() has failed");
+    }
+    return rc;
+}
+
+void UringEventLoop::arm(const int fd)
+{
+    io_uring_sqe* sqe = acquire();
+    Slot& entry(slot(fd));
+    sqe->fd        = fd;
+    sqe->user_data = uring_encode(entry.kind, entry.generation, fd);
+    switch(entry.kind) {
+        case KIND_POLL:
+            /* oneshot polls are re-armed after dispatch to provide level-triggered semantics */
+            sqe->opcode        = IORING_OP_POLL_ADD;
+            sqe->poll32_events = to_poll_events(entry.events);
+            if(entry.events & EV_EDGE) {
+                sqe->len = IORING_POLL_ADD_MULTI;
+            }
+            break;
+        case KIND_ACCEPT:
+            sqe->opcode       = IORING_OP_ACCEPT;
+            sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+            break;
+        case KIND_RECV:
+            sqe->opcode    = IORING_OP_RECV;
+            sqe->ioprio    = IORING_RECV_MULTISHOT;
+            sqe->flags     = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = uring_buffer_group;
+            entry.receiving = true;
+            break;
+        default:
+            throw std::runtime_error("io_uring request is invalid");
+    }
+}
+
+void UringEventLoop::cancel(const uint64_t user_data)
+{
+    io_uring_sqe* sqe = acquire();
+    sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+    sqe->fd        = -1;
+    sqe->addr      = user_data;
+    sqe->user_data = uring_encode(KIND_CANCEL, 0, 0);
+}
+
+void UringEventLoop::retry(const int fd, const bool soon)
+{
+    /* a request that failed for lack of resources is armed again once a timeout has elapsed */
+    io_uring_sqe* sqe = acquire();
+    Slot& entry(slot(fd));
+    sqe->opcode    = IORING_OP_TIMEOUT;
+    sqe->fd        = -1;
+    sqe->addr      = reinterpret_cast<uint64_t>(soon ? &uring_retry_soon : &uring_retry_later);
+    sqe->len       = 1;
+    sqe->user_data = uring_encode(KIND_RETRY, entry.generation, fd);
+}
+
+void UringEventLoop::complete(const io_uring_cqe& cqe)
+{
+    const uint64_t kind       = (cqe.user_data >> 56);
+    const uint32_t generation = (cqe.user_data >> 32) & 0xffffff;
+    const int      index      = static_cast<int>(cqe.user_data & 0xffffffff);
+    const bool     more       = ((cqe.flags & IORING_CQE_F_MORE) != 0);
+
+    switch(kind) {
+        case KIND_POLL:
+            if(current(index, generation) && (cqe.res > 0)) {
+                if(cqe.res & (POLLIN | POLLHUP | POLLERR)) {
+                    notifyReadable(index);
+                }
+                if((cqe.res & POLLOUT) && current(index, generation)) {
+                    notifyWritable(index);
+                }
+            }
+            if(!more && (cqe.res >= 0) && current(index, generation)) {
+                arm(index);
+            }
+            break;
+        case KIND_ACCEPT:
+            if(!current(index, generation)) {
+                if(cqe.res >= 0) {
+                    static_cast<void>(::close(cqe.res));
+                }
+                break;
+            }
+            if(cqe.res >= 0) {
+                notifyAccepted(index, cqe.res);
+            }
+            /* running out of descriptors or memory would fail again at once, the accept waits for a while instead */
+            if(!more && (cqe.res != -ECANCELED) && current(index, generation)) {
+                switch(uring_accept_retry(cqe.res)) {
+                    case URING_RETRY_NOW:
+                        arm(index);
+                        break;
+                    case URING_RETRY_LATER:
+                        retry(index, false);
+                        break;
+                    default:
+                        Logger::log(Logger::ERROR, "io_uring accept on %lld has failed with error %lld", index, -cqe.res);
+                        break;
+                }
+            }
+            break;
+        case KIND_RECV:
+            {
+                const unsigned bid = (cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                if(current(index, generation)) {
+                    if(cqe.res > 0) {
+                        notifyReceived(index, _buffers + bid * uring_buffer_size, cqe.res);
+                    }
+                    else if((cqe.res != -ENOBUFS) && (cqe.res != -ECANCELED)) {
+                        notifyReceived(index, nullptr, 0);
+                    }
+                }
+                if(cqe.flags & IORING_CQE_F_BUFFER) {
+                    recycle(bid);
+                }
+                /*
+                 * running out of provided buffers, or a pause lifted meanwhile, terminates
+                 * the multishot receive; buffers are only handed back by the next submission,
+                 * so the receive waits a little rather than failing again straight away
+                 */
+                if(!more && current(index, generation)) {
+                    Slot& entry(_slots[index]);
+                    entry.receiving = false;
+                    if(entry.paused) {
+                        break;
+                    }
+                    if((cqe.res > 0) || (cqe.res == -ECANCELED)) {
+                        arm(index);
+                    }
+                    else if(cqe.res == -ENOBUFS) {
+                        retry(index, true);
+                    }
+                }
+            }
+            break;
+        case KIND_SEND:
+            {
+                SendRequest& request(*_requests[index]);
+                const int      fd = request.fd;
+                const uint32_t gn = request.generation;
+                request.pinned.clear();
+                _free_requests.push_back(index);
+                if(current(fd, gn & 0xffffff)) {
+                    _slots[fd].request = -1;
+                    notifySent(fd, cqe.res);
+                }
+            }
+            break;
+        case KIND_WRITE:
+            if(current(index, generation)) {
+                _slots[index].events &= ~EV_WRITE;
+                notifyWritable(index);
+            }
+            break;
+        case KIND_RETRY:
+            if(current(index, generation)) {
+                const Slot& entry(_slots[index]);
+                if((entry.kind == KIND_ACCEPT) || ((entry.kind == KIND_RECV) && !entry.receiving && !entry.paused)) {
+                    arm(index);
+                }
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+void UringEventLoop::recycle(const unsigned bid)
+{
+    /* the buffer is handed back with the next submission, ahead of any re-armed receive */
+    io_uring_sqe* sqe = acquire();
+    sqe->opcode    = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd        = 1;
+    sqe->addr      = reinterpret_cast<uint64_t>(_buffers + bid * uring_buffer_size);
+    sqe->len       = uring_buffer_size;
+    sqe->off       = bid;
+    sqe->buf_group = uring_buffer_group;
+    sqe->user_data = uring_encode(KIND_BUFFER, 0, 0);
+}
+
+#endif
+
+// ---------------------------------------------------------------------------
+// ChatWorker
+// ---------------------------------------------------------------------------
+
+namespace {
+
+constexpr uint64_t worker_tick         = 10;
+constexpr int      worker_drain_check  = 50;
+constexpr uint64_t worker_accept_retry = 100;
+
+uint64_t worker_clock()
+{
+    return Metrics::now() / 1000000;
+}
+
+double worker_burst(const double rate, const double burst)
+{
+    return std::max((burst > 0 ? burst : rate), 1.0);
+}
+
+uint64_t worker_timer(const ConnectionHandle& handle, const unsigned kind)
+{
+    return (static_cast<uint64_t>(handle.generation) << 32) | (static_cast<uint64_t>(handle.fd) << 2) | kind;
+}
+
+bool is_valid_name(const char* begin, const char* end, const size_t max_length)
+{
+    if((begin == end) || (static_cast<size_t>(end - begin) > max_length)) {
+        return false;
+    }
+    for(const char* it = begin; it != end; ++it) {
+        if(static_cast<unsigned char>(*it) <= ' ') {
+            return false;
+        }
+    }
+    return true;
+}
+
+}
+
+ChatWorker::ChatWorker(ChatServer& server, const ChatConfig& config, const unsigned index)
+    : EventListener()
+    , _server(server)
+    , _config(config)
+    , _index(index)
+    , _event_loop(EventLoop::create(config.backend, *this))
+    , _listener()
+    , _clients()
+    , _rooms()
+    , _room_ids()
+    , _room_key()
+    , _pending()
+    , _backlog()
+    , _closing()
+    , _iovecs(IOV_MAX)
+    , _recent()
+    , _metrics()
+    , _received_at(0)
+    , _timers(worker_tick, worker_clock())
+    , _expired()
+    , _now(worker_clock())
+    , _drain_deadline(0)
+    , _accept_retry(0)
+    , _wakeup_fd(-1)
+    , _reserve_fd(-1)
+    , _mutex()
+    , _inbox()
+    , _inbox_spare()
+    , _quit(false)
+    , _draining(false)
+    , _thread()
+{
+    _wakeup_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(_wakeup_fd < 0) {
+        throw std::runtime_error("eventfd() has failed");
+    }
+    _event_loop->add(_wakeup_fd, EventLoop::EV_READ);
+    /* a descriptor held in reserve lets the worker turn clients away once it has run out of them */
+    _reserve_fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if(_reserve_fd < 0) {
+        throw std::runtime_error("open() has failed");
+    }
+    _recent.reserve(config.recent);
+}
+
+ChatWorker::~ChatWorker()
+{
+    join();
+    if(_reserve_fd >= 0) {
+        _reserve_fd = (::close(_reserve_fd), -1);
+    }
+    if(_wakeup_fd >= 0) {
+        _wakeup_fd = (::close(_wakeup_fd), -1);
+    }
+}
+
+void ChatWorker::listen(const uint32_t addr, const uint16_t port, const bool reuseport)
+{
+    _listener.create();
+    _listener.set_reuseaddr(true);
+    if(reuseport) {
+        _listener.set_reuseport(true);
+    }
+    _listener.set_nonblock(true);
+    _listener.bind(addr, port);
+    _listener.listen(_config.backlog);
+    watchListener();
+}
+
+void ChatWorker::adopt(const int fd)
+{
+    /* a listener handed over by a previous server keeps its pending connections */
+    _listener.reset(fd);
+    _listener.set_nonblock(true);
+    watchListener();
+}
+
+void ChatWorker::start()
+{
+    auto routine = [this]() -> void
+    {
+        try {
+            run();
+        }
+        catch(const std::exception& e) {
+            Logger::log(Logger::ERROR, "worker %lld error: ", _index, 0, e.what());
+            _server.quit();
+        }
+    };
+
+    _thread = std::thread(routine);
+}
+
+void ChatWorker::run()
+{
+    while(!_quit) {
+        /* the wait returns in time for the next timer, the timers are not ticked otherwise */
+        int timeout = (_backlog.empty() ? _timers.timeout(worker_clock()) : 0);
+        if(_draining && ((timeout < 0) || (timeout > worker_drain_check))) {
+            timeout = worker_drain_check;
+        }
+        if((_accept_retry != 0) && ((timeout < 0) || (timeout > static_cast<int>(worker_accept_retry)))) {
+            timeout = worker_accept_retry;
+        }
+        _event_loop->wait(timeout);
+        expireTimers();
+        if((_accept_retry != 0) && (_now >= _accept_retry)) {
+            _accept_retry = 0;
+            acceptClients();
+        }
+        readBacklog();
+        if(_draining) {
+            drainClients();
+        }
+        flushPending();
+        reapClients();
+    }
+    shutdown();
+}
+
+void ChatWorker::join()
+{
+    if(_thread.joinable()) {
+        _thread.join();
+    }
+}
+
+void ChatWorker::stop()
+{
+    _quit = true;
+    wakeup();
+}
+
+void ChatWorker::drain()
+{
+    _draining = true;
+    wakeup();
+}
+
+void ChatWorker::post(const MessagePtr& msg, const uint32_t room)
+{
+    enqueue(Delivery{msg, room, ConnectionHandle{-1, 0}});
+}
+
+void ChatWorker::post(const MessagePtr& msg, const ConnectionHandle& target)
+{
+    enqueue(Delivery{msg, 0, target});
+}
+
+void ChatWorker::deliver(const MessagePtr& msg, const uint32_t room, const int sender)
+{
+    /* every recipient shares the same immutable buffer */
+    if(room != 0) {
+        const RoomTable::Subscribers* subscribers = _rooms.find(room);
+        if(subscribers == nullptr) {
+            return;
+        }
+        for(const auto& handle : *subscribers) {
+            Connection* client = _clients.find(handle);
+            if((client == nullptr) || (client->fd() == sender) || client->closing()) {
+                continue;
+            }
+            if(!sendMsgToClient(*client, msg)) {
+                closeClient(*client);
+            }
+        }
+        return;
+    }
+    const size_t count = _clients.size();
+    for(size_t index = 0; index < count; ++index) {
+        Connection& client(_clients[index]);
+        if((client.fd() == sender) || client.closing()) {
+            continue;
+        }
+        if(!sendMsgToClient(client, msg)) {
+            closeClient(client);
+        }
+    }
+}
+
+void ChatWorker::deliver(const MessagePtr& msg, const ConnectionHandle& target)
+{
+    /* the handle may be stale if the recipient left while the message was in flight */
+    Connection* client = _clients.find(target);
+    if((client != nullptr) && !client->closing() && !sendMsgToClient(*client, msg)) {
+        closeClient(*client);
+    }
+}
+
+void ChatWorker::dump(std::ostream& stream) const
+{
+    const uint64_t send_calls    = _metrics.get(Metrics::SEND_CALLS);
+    const uint64_t send_messages = _metrics.get(Metrics::MESSAGES_OUT);
+    const double   ratio         = (send_calls != 0 ? static_cast<double>(send_messages) / send_calls : 0.0);
+    const Histogram& latency(_metrics.latency());
+    const Histogram& rtt(_metrics.rtt());
+
+    stream << "worker " << _index << ':';
+    for(unsigned counter = 0; counter < Metrics::COUNTERS; ++counter) {
+        stream << ' ' << Metrics::name(static_cast<Metrics::Counter>(counter)) << '=' << _metrics.get(static_cast<Metrics::Counter>(counter));
+    }
+    stream << " messages_per_call=" << ratio
+           << " latency_p50_us=" << (latency.percentile(0.50) / 1000)
+           << " latency_p99_us=" << (latency.percentile(0.99) / 1000)
+           << " latency_p999_us=" << (latency.percentile(0.999) / 1000)
+           << " rtt_p50_us=" << (rtt.percentile(0.50) / 1000)
+           << " rtt_p99_us=" << (rtt.percentile(0.99) / 1000)
+           << std::endl;
+}
+
+void ChatWorker::onReadable(const int fd)
+{
+    if(_quit) {
+        return;
+    }
+    if(fd == _wakeup_fd) {
+        drainInbox();
+    }
+    else if(fd == _listener.fd()) {
+        acceptClients();
+    }
+    else {
+        readClient(fd);
+    }
+}
+
+void ChatWorker::onWritable(const int fd)
+{
+    if(_quit) {
+        return;
+    }
+    Connection* client = _clients.find(fd);
+    if((client != nullptr) && !client->closing() && !flushClient(*client)) {
+        closeClient(*client);
+    }
+}
+
+void ChatWorker::onAccepted(const int fd, const int client_fd)
+{
+    if(_quit) {
+        static_cast<void>(::close(client_fd));
+        return;
+    }
+    /* a multishot accept does not report the peer, it is only looked up when admission is enforced */
+    EndPoint peer;
+    if(_server.admitting()) {
+        socklen_t size = peer.size();
+        static_cast<void>(::getpeername(client_fd, peer.data(), &size));
+    }
+    if(admitClient(client_fd, peer)) {
+        registerClient(client_fd);
+    }
+}
+
+void ChatWorker::onReceived(const int fd, const char* data, const size_t size)
+{
+    if(_quit) {
+        return;
+    }
+    Connection* client = _clients.find(fd);
+    if((client == nullptr) || client->closing()) {
+        return;
+    }
+    if(size == 0) {
+        closeClient(*client);
+        return;
+    }
+    /* the provided buffer goes back to the kernel as soon as this callback returns */
+    LineFramer& inbound(client->inbound());
+    inbound.reserve(size);
+    ::memcpy(inbound.tail(), data, size);
+    inbound.commit(size);
+    _metrics.add(Metrics::BYTES_IN, size);
+    _received_at = Metrics::now();
+    static_cast<void>(parseClient(*client));
+}
+
+void ChatWorker::onSent(const int fd, const ssize_t result)
+{
+    Connection* client = _clients.find(fd);
+    if(client == nullptr) {
+        return;
+    }
+    MessageQueue& outbound(client->outbound());
+    client->set_writing(false);
+    outbound.unpin();
+    if(result < 0) {
+        if(!client->closing()) {
+            Logger::log(Logger::WARN, "sendmsg() has failed", 0, 0);
+            closeClient(*client);
+        }
+        return;
+    }
+    recordSent(*client, result);
+    Connection::Catchup& catchup(client->catchup());
+    const size_t         done = outbound.consume(result);
+    _metrics.add(Metrics::MESSAGES_OUT, done);
+    catchup.barrier -= std::min(done, catchup.barrier);
+    /* whatever was queued during the send goes out with the next batch */
+    if(!client->closing() && (!outbound.empty() || (catchup.offset < catchup.end)) && !client->pending()) {
+        client->set_pending(true);
+        _pending.push_back(client->handle());
+    }
+}
+
+void ChatWorker::enqueue(const Delivery& delivery)
+{
+    bool was_empty = false;
+    {
+        const std::lock_guard<std::mutex> lock(_mutex);
+        was_empty = _inbox.empty();
+        _inbox.push_back(delivery);
+    }
+    /* a single wakeup is enough until the owner drains the inbox */
+    if(was_empty) {
+        wakeup();
+    }
+}
+
+void ChatWorker::wakeup()
+{
+    const uint64_t value = 1;
+    const ssize_t rc = ::write(_wakeup_fd, &value, sizeof(value));
+    static_cast<void>(rc);
+}
+
+void ChatWorker::drainInbox()
+{
+    uint64_t value = 0;
+    const ssize_t rc = ::read(_wakeup_fd, &value, sizeof(value));
+    static_cast<void>(rc);
+
+    /* the inbox vectors are swapped back and forth to keep their capacity */
+    {
+        const std::lock_guard<std::mutex> lock(_mutex);
+        _inbox_spare.swap(_inbox);
+    }
+    for(const auto& delivery : _inbox_spare) {
+        if(delivery.target.fd >= 0) {
+            deliver(delivery.msg, delivery.target);
+        }
+        else {
+            deliver(delivery.msg, delivery.room, -1);
+        }
+    }
+    _inbox_spare.clear();
+}
+
+void ChatWorker::watchListener()
+{
+    if(_event_loop->completions()) {
+        _event_loop->accept(_listener.fd());
+    }
+    else {
+        _event_loop->add(_listener.fd(), EventLoop::EV_READ | EventLoop::EV_EDGE);
+    }
+}
+
+void ChatWorker::acceptClients()
+{
+    /*
+     * the listener is edge-triggered, drain the whole accept queue; out of descriptors,
+     * pending clients are turned away so that the queue still empties, and should even
+     * that fail, the accept is retried later since no new edge may ever come
+     */
+    EndPoint peer;
+    bool     exhausted = false;
+    while(_listener.fd() >= 0) {
+        const int client_fd = _listener.accept(peer);
+        if(client_fd >= 0) {
+            if(admitClient(client_fd, peer)) {
+                registerClient(client_fd);
+            }
+            continue;
+        }
+        if((errno != EMFILE) && (errno != ENFILE)) {
+            break;
+        }
+        if(!exhausted) {
+            exhausted = true;
+            Logger::log(Logger::WARN, "worker %lld is out of file descriptors", _index, 0);
+        }
+        if(shedClient()) {
+            continue;
+        }
+        if((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+            _accept_retry = _now + worker_accept_retry;
+        }
+        break;
+    }
+}
+
+bool ChatWorker::admitClient(const int client_fd, const EndPoint& peer)
+{
+    /* a rejected client is told why, without waiting for its socket to be writable */
+    if(!_server.admitting() || _server.admit(peer.addr())) {
+        return true;
+    }
+    static const char notice[] = "* too many connections\r\n";
+    static_cast<void>(::send(client_fd, notice, sizeof(notice) - 1, MSG_DONTWAIT | MSG_NOSIGNAL));
+    static_cast<void>(::close(client_fd));
+    _metrics.add(Metrics::REJECTS, 1);
+    Logger::log(Logger::DEBUG, "Client %lld rejected by admission control", client_fd, 0);
+    return false;
+}
+
+bool ChatWorker::shedClient()
+{
+    /* the reserve descriptor makes room to accept a pending client, only to close it at once */
+    if(_reserve_fd < 0) {
+        _reserve_fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+        errno       = EMFILE;
+        return false;
+    }
+    _reserve_fd = (::close(_reserve_fd), -1);
+    const int client_fd = ::accept4(_listener.fd(), nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    const int error     = errno;
+    if(client_fd >= 0) {
+        static const char notice[] = "* server is full\r\n";
+        static_cast<void>(::send(client_fd, notice, sizeof(notice) - 1, MSG_DONTWAIT | MSG_NOSIGNAL));
+        static_cast<void>(::close(client_fd));
+        _metrics.add(Metrics::REJECTS, 1);
+    }
+    _reserve_fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+    errno       = error;
+    return client_fd >= 0;
+}
+
+void ChatWorker::registerClient(const int client_fd)
+{
+    _clients.insert(client_fd, _config.max_line);
+    if(_event_loop->completions()) {
+        _event_loop->receive(client_fd);
+    }
+    else {
+        _event_loop->add(client_fd, EventLoop::EV_READ | EventLoop::EV_EDGE);
+    }
+    Logger::log(Logger::INFO, "New client connected: %lld (worker %lld)", client_fd, _index);
+    _metrics.add(Metrics::ACCEPTS, 1);
+    /* the recent messages are queued as is, and leave with a single write at the end of the iteration */
+    Connection* client = _clients.find(client_fd);
+    client->set_connected_at(Metrics::now());
+    client->throttle() = Connection::Throttle{worker_burst(_config.message_rate, _config.message_burst), worker_burst(_config.byte_rate, _config.byte_burst), _now, false};
+    armTimer(*client, TIMER_READ, readDeadline(*client));
+    if(_config.ping_interval != 0) {
+        armTimer(*client, TIMER_PING, _now + (_config.ping_interval * 1000ULL));
+    }
+    _server.recent(_recent);
+    for(const auto& msg : _recent) {
+        if(!sendMsgToClient(*client, msg)) {
+            closeClient(*client);
+            break;
+        }
+    }
+    _recent.clear();
+}
+
+void ChatWorker::readClient(const int fd)
+{
+    Connection* client = _clients.find(fd);
+    if((client == nullptr) || client->closing() || client->throttle().paused) {
+        return;
+    }
+    /*
+     * clients are edge-triggered and must be read until the socket is drained,
+     * but a bounded number of reads per iteration lets queued output be flushed
+     * in between; a client with data left is revisited on the next iteration
+     */
+    LineFramer& inbound(client->inbound());
+    for(int budget = 8; budget >= 0; --budget) {
+        if(budget == 0) {
+            if(!client->backlogged()) {
+                client->set_backlogged(true);
+                _backlog.push_back(client->handle());
+            }
+            break;
+        }
+        inbound.reserve(4096);
+        size_t room = inbound.room();
+        if(_config.byte_rate > 0) {
+            /* a read never takes more than the byte bucket holds, the rest is left in the socket */
+            refillClient(*client);
+            room = std::min(room, static_cast<size_t>(std::max(client->throttle().bytes, 1.0)));
+        }
+        const ssize_t bytes_read = ::recv(fd, inbound.tail(), room, 0);
+        if(bytes_read > 0) {
+            inbound.commit(bytes_read);
+            _metrics.add(Metrics::BYTES_IN, bytes_read);
+            _received_at = Metrics::now();
+            if(!parseClient(*client) || client->throttle().paused) {
+                break;
+            }
+            continue;
+        }
+        if(bytes_read < 0) {
+            if((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                break;
+            }
+            if(errno == EINTR) {
+                continue;
+            }
+        }
+        closeClient(*client);
+        break;
+    }
+}
+
+bool ChatWorker::parseClient(Connection& client)
+{
+    /* every complete line of the batch is handled in place, those of a paused client wait for it to resume */
+    LineFramer& inbound(client.inbound());
+    const char* line   = nullptr;
+    size_t      length = 0;
+    while(!client.throttle().paused && inbound.next(line, length)) {
+        handleLine(client, line, length);
+    }
+    if(!client.throttle().paused && inbound.overflow()) {
+        Logger::log(Logger::WARN, "Client %lld sent a line too long, disconnecting", client.fd(), 0);
+        closeClient(client);
+        return false;
+    }
+    return true;
+}
+
+void ChatWorker::readBacklog()
+{
+    /* clients still backlogged after this pass are appended behind the current ones */
+    const size_t count = _backlog.size();
+    for(size_t index = 0; index < count; ++index) {
+        const ConnectionHandle handle(_backlog[index]);
+        Connection* client = _clients.find(handle);
+        if((client != nullptr) && !client->closing()) {
+            client->set_backlogged(false);
+            readClient(handle.fd);
+        }
+    }
+    _backlog.erase(_backlog.begin(), _backlog.begin() + count);
+}
+
+void ChatWorker::handleLine(Connection& client, const char* line, const size_t length)
+{
+    /* the idle timer notices the activity lazily, when it expires */
+    client.timers().last_read = _now;
+    if(length == 0) {
+        return;
+    }
+    chargeClient(client, 1.0, length + 1);
+    _metrics.add(Metrics::MESSAGES_IN, 1);
+    if(line[0] == '/') {
+        handleCommand(client, line, length);
+        return;
+    }
+    if(line[0] == '#') {
+        handleRoomLine(client, line, length);
+        return;
+    }
+    Logger::log(Logger::INFO, "Message from client %lld: ", client.fd(), 0, line, length);
+    _server.broadcast(*this, client.fd(), Message::create_line(line, length, _received_at), 0);
+}
+
+void ChatWorker::handleCommand(Connection& client, const char* line, const size_t length)
+{
+    const char* end  = line + length;
+    const char* verb = line + 1;
+    const char* args = std::find(verb, end, ' ');
+    const std::string command(verb, args);
+    while((args != end) && (*args == ' ')) {
+        ++args;
+    }
+    const std::string argument(args, end);
+
+    if(command == "join") {
+        const uint32_t room = lookupRoom(argument.data(), argument.size(), true);
+        if(room == 0) {
+            reply(client, "* cannot join " + argument);
+            return;
+        }
+        std::vector<uint32_t>& rooms(client.rooms());
+        if(std::find(rooms.begin(), rooms.end(), room) == rooms.end()) {
+            rooms.push_back(room);
+            _rooms.join(room, client.handle());
+        }
+        reply(client, "* joined " + argument);
+    }
+    else if(command == "leave") {
+        const uint32_t room = lookupRoom(argument.data(), argument.size(), false);
+        std::vector<uint32_t>& rooms(client.rooms());
+        auto it = std::find(rooms.begin(), rooms.end(), room);
+        if((room == 0) || (it == rooms.end())) {
+            reply(client, "* not in " + argument);
+            return;
+        }
+        *it = rooms.back();
+        rooms.pop_back();
+        _rooms.leave(room, client.handle());
+        reply(client, "* left " + argument);
+    }
+    else if(command == "nick") {
+        if(!is_valid_name(argument.data(), argument.data() + argument.size(), 32) || (argument[0] == '#') || (argument[0] == '@')) {
+            reply(client, "* invalid nickname " + argument);
+            return;
+        }
+        if(argument == client.nickname()) {
+            reply(client, "* you are " + argument);
+            return;
+        }
+        /* the new nickname is claimed before the old one is released, so a collision keeps the old one */
+        if(!_server.registerNick(argument, *this, client.handle())) {
+            reply(client, "* nickname " + argument + " is taken");
+            return;
+        }
+        if(!client.nickname().empty()) {
+            _server.releaseNick(client.nickname(), *this, client.handle());
+        }
+        client.set_nickname(argument);
+        reply(client, "* you are " + argument);
+    }
+    else if(command == "msg") {
+        const size_t      space = argument.find(' ');
+        const std::string nick(argument, 0, space);
+        if(client.nickname().empty()) {
+            reply(client, "* choose a nickname first");
+            return;
+        }
+        if(nick.empty() || (space == std::string::npos)) {
+            reply(client, "* usage: /msg nickname text");
+            return;
+        }
+        const std::string line("@" + client.nickname() + argument.substr(space));
+        if(!_server.sendPrivate(*this, nick, Message::create_line(line.data(), line.size(), _received_at))) {
+            reply(client, "* no such nickname " + nick);
+        }
+    }
+    else if(command == "history") {
+        /* "/history [count]", the last 20 public messages by default */
+        size_t count = 20;
+        if(!argument.empty()) {
+            char* last = nullptr;
+            count = ::strtoul(argument.c_str(), &last, 10);
+            if((last == nullptr) || (*last != '\0')) {
+                reply(client, "* usage: /history [count]");
+                return;
+            }
+        }
+        std::vector<MessagePtr> messages;
+        if(!_server.history(count, messages)) {
+            reply(client, "* history is disabled");
+            return;
+        }
+        for(const auto& msg : messages) {
+            if(!sendMsgToClient(client, msg)) {
+                closeClient(client);
+                break;
+            }
+        }
+    }
+    else if(command == "pong") {
+        handlePong(client, argument);
+    }
+    else if(command == "since") {
+        /* "/since sequence|@offset", the transcript from there on, followed by where it ends; sequences start at 1 */
+        Transcript* transcript = _server.transcript();
+        if(transcript == nullptr) {
+            reply(client, "* transcript is disabled");
+            return;
+        }
+        Connection::Catchup& catchup(client.catchup());
+        if(catchup.offset < catchup.end) {
+            reply(client, "* catch-up in progress");
+            return;
+        }
+        const bool         at   = (!argument.empty() && (argument[0] == '@'));
+        const char*        text = argument.c_str() + (at ? 1 : 0);
+        char*              last = nullptr;
+        const uint64_t     from = ::strtoull(text, &last, 10);
+        Transcript::Range  range{0, 0, 0};
+        if((*text == '\0') || (last == nullptr) || (*last != '\0') || (!at && (from == 0))) {
+            reply(client, "* usage: /since sequence|@offset");
+            return;
+        }
+        try {
+            if(at ? transcript->seek(from, range) : transcript->locate(from, range)) {
+                catchup = Connection::Catchup{range.offset, range.end, client.outbound().size()};
+            }
+        } catch (const std::exception& e) {
+            Logger::log(Logger::ERROR, "", 0, 0, e.what());
+            reply(client, "* transcript is unavailable");
+            return;
+        }
+        reply(client, "* transcript at " + std::to_string(range.last + 1) + " @" + std::to_string(range.end));
+    }
+    else {
+        reply(client, "* unknown command " + command);
+    }
+}
+
+void ChatWorker::handleRoomLine(Connection& client, const char* line, const size_t length)
+{
+    /* "#room text" is relayed as is, only to the subscribers of the room */
+    const char*    name = std::find(line, line + length, ' ');
+    const uint32_t room = lookupRoom(line, name - line, false);
+    const std::vector<uint32_t>& rooms(client.rooms());
+    if((room == 0) || (std::find(rooms.begin(), rooms.end(), room) == rooms.end())) {
+        reply(client, "* not in " + std::string(line, name));
+        return;
+    }
+    Logger::log(Logger::INFO, "Message from client %lld: ", client.fd(), 0, line, length);
+    _server.broadcast(*this, client.fd(), Message::create_line(line, length, _received_at), room);
+}
+
+uint32_t ChatWorker::lookupRoom(const char* name, const size_t length, const bool create)
+{
+    /* names may be given with or without their leading '#' */
+    const char* begin = ((length > 0) && (name[0] == '#') ? name + 1 : name);
+    const char* end   = name + length;
+    if(!is_valid_name(begin, end, 64)) {
+        return 0;
+    }
+    /* identifiers are cached per worker, so room traffic does not contend on the server lock */
+    _room_key.assign(begin, end);
+    auto it = _room_ids.find(_room_key);
+    if(it != _room_ids.end()) {
+        return it->second;
+    }
+    const uint32_t room = _server.room(_room_key, create);
+    if(room != 0) {
+        _room_ids.emplace(_room_key, room);
+    }
+    return room;
+}
+
+void ChatWorker::reply(Connection& client, const std::string& text)
+{
+    if(!sendMsgToClient(client, Message::create_line(text.data(), text.size()))) {
+        closeClient(client);
+    }
+}
+
+void ChatWorker::closeClient(Connection& client)
+{
+    /* the connection is reaped at the end of the iteration, so references to the table stay valid */
+    if(!client.closing()) {
+        Logger::log(Logger::INFO, "Client disconnected: %lld", client.fd(), 0);
+        client.set_closing(true);
+        _metrics.add(Metrics::DISCONNECTS, 1);
+        _closing.push_back(client.handle());
+    }
+}
+
+void ChatWorker::reapClients()
+{
+    for(const auto& handle : _closing) {
+        Connection* client = _clients.find(handle);
+        if(client != nullptr) {
+            for(const uint32_t room : client->rooms()) {
+                _rooms.leave(room, handle);
+            }
+            if(!client->nickname().empty()) {
+                _server.releaseNick(client->nickname(), *this, handle);
+            }
+            _timers.cancel(client->timers().read);
+            _timers.cancel(client->timers().write);
+            _timers.cancel(client->timers().ping);
+            _timers.cancel(client->timers().resume);
+            _event_loop->remove(handle.fd);
+            _clients.erase(handle.fd);
+        }
+    }
+    _closing.clear();
+}
+
+void ChatWorker::drainClients()
+{
+    /* the listener goes first, then every client as soon as its pending output has left */
+    if(_drain_deadline == 0) {
+        _drain_deadline = _now + (_config.drain_timeout * 1000ULL) + 1;
+        if(_listener.fd() >= 0) {
+            _event_loop->remove(_listener.fd());
+            _listener.close();
+        }
+        _accept_retry = 0;
+        const std::string text("* server is shutting down");
+        const MessagePtr  notice(Message::create_line(text.data(), text.size()));
+        const size_t      count = _clients.size();
+        for(size_t index = 0; index < count; ++index) {
+            Connection& client(_clients[index]);
+            if(!client.closing() && !sendMsgToClient(client, notice)) {
+                closeClient(client);
+            }
+        }
+        return;
+    }
+    if(_clients.empty() || (_now >= _drain_deadline)) {
+        if(!_clients.empty()) {
+            Logger::log(Logger::WARN, "worker %lld gave up draining %lld clients", _index, _clients.size());
+        }
+        _quit = true;
+        return;
+    }
+    const size_t count = _clients.size();
+    for(size_t index = 0; index < count; ++index) {
+        Connection&                client(_clients[index]);
+        const Connection::Catchup& catchup(client.catchup());
+        if(!client.closing() && !client.writing() && !client.pending() && client.outbound().empty() && (catchup.offset >= catchup.end)) {
+            closeClient(client);
+        }
+    }
+}
+
+void ChatWorker::shutdown()
+{
+    _listener.close();
+    _rooms.clear();
+    _clients.clear();
+    _pending.clear();
+    _backlog.clear();
+    _closing.clear();
+}
+
+bool ChatWorker::sendMsgToClient(Connection& client, const MessagePtr& msg) {
+    MessageQueue& outbound(client.outbound());
+
+    /* a write stall is measured from the moment output becomes pending, or from the last progress */
+    if(outbound.empty()) {
+        client.timers().last_write = _now;
+        if((_config.write_timeout != 0) && (client.timers().write == TimerWheel::NONE)) {
+            armTimer(client, TIMER_WRITE, _now + (_config.write_timeout * 1000ULL));
+        }
+    }
+    outbound.push_back(msg);
+    const size_t limit = queueLimit(client);
+    if(outbound.bytes() > limit) {
+        if(_config.queue_policy == ChatConfig::DISCONNECT) {
+            Logger::log(Logger::WARN, "Client %lld is too slow (rtt %lld us), disconnecting", client.fd(), client.heartbeat().srtt / 1000);
+            return false;
+        }
+        /* a catch-up stays behind the messages queued before it, the dropped ones no longer count */
+        Connection::Catchup& catchup(client.catchup());
+        size_t               position = 0;
+        while((outbound.bytes() > limit) && outbound.drop_oldest(position)) {
+            _metrics.add(Metrics::QUEUE_DROPS, 1);
+            if(position < catchup.barrier) {
+                --catchup.barrier;
+            }
+        }
+    }
+    /* a client waiting for writability will be flushed by onWritable(), others at the end of the iteration */
+    if(!client.writing() && !client.pending()) {
+        client.set_pending(true);
+        _pending.push_back(client.handle());
+    }
+    return true;
+}
+
+void ChatWorker::flushPending()
+{
+    for(const auto& handle : _pending) {
+        Connection* client = _clients.find(handle);
+        if((client == nullptr) || client->closing()) {
+            continue;
+        }
+        client->set_pending(false);
+        if(!flushClient(*client)) {
+            closeClient(*client);
+        }
+    }
+    _pending.clear();
+}
+
+bool ChatWorker::flushClient(Connection& client) {
+    MessageQueue&        outbound(client.outbound());
+    Connection::Catchup& catchup(client.catchup());
+    /* a catch-up goes out after the messages queued before it was requested, and before the others */
+    catchup.barrier = std::min(catchup.barrier, outbound.size());
+    if(_event_loop->completions()) {
+        if(client.writing()) {
+            return true;
+        }
+        try {
+            if((catchup.offset < catchup.end) && (catchup.barrier == 0) && !flushCatchup(client)) {
+                _event_loop->modify(client.fd(), clientEvents(client, true));
+                return true;
+            }
+        } catch (const std::exception& e) {
+            Logger::log(Logger::WARN, "", 0, 0, e.what());
+            return false;
+        }
+        /* a single send is kept in flight, its completion schedules the next batch */
+        const size_t limit = ((catchup.offset < catchup.end) ? catchup.barrier : outbound.size());
+        if(limit > 0) {
+            outbound.pin(_event_loop->send(client.fd(), outbound, limit));
+            _metrics.add(Metrics::SEND_CALLS, 1);
+            client.set_writing(true);
+        }
+        return true;
+    }
+    try {
+        /* coalesce every queued message into as few sendmsg() calls as possible */
+        while(true) {
+            const bool active = (catchup.offset < catchup.end);
+            if(active && (catchup.barrier == 0)) {
+                if(!flushCatchup(client)) {
+                    break;
+                }
+                continue;
+            }
+            if(outbound.empty()) {
+                break;
+            }
+            const size_t count = outbound.gather(_iovecs.data(), (active ? std::min(_iovecs.size(), catchup.barrier) : _iovecs.size()));
+            size_t bytes = 0;
+            for(size_t index = 0; index < count; ++index) {
+                bytes += _iovecs[index].iov_len;
+            }
+            const size_t sent = client.socket().send(_iovecs.data(), count);
+            recordSent(client, sent);
+            const size_t done = outbound.consume(sent);
+            _metrics.add(Metrics::SEND_CALLS, 1);
+            _metrics.add(Metrics::MESSAGES_OUT, done);
+            catchup.barrier -= std::min(done, catchup.barrier);
+            if(sent < bytes) {
+                break;
+            }
+        }
+    } catch (const std::exception& e) {
+        Logger::log(Logger::WARN, "", 0, 0, e.what());
+        return false;
+    }
+    const bool writing = (!outbound.empty() || (catchup.offset < catchup.end));
+    if(client.writing() != writing) {
+        _event_loop->modify(client.fd(), clientEvents(client, writing));
+        client.set_writing(writing);
+    }
+    return true;
+}
+
+bool ChatWorker::flushCatchup(Connection& client)
+{
+    /* the transcript goes from the page cache to the socket without being copied through user space */
+    Connection::Catchup& catchup(client.catchup());
+    const int            fd = _server.transcript()->fd();
+    while(catchup.offset < catchup.end) {
+        const size_t sent = client.socket().send_file(fd, catchup.offset, catchup.end - catchup.offset);
+        _metrics.add(Metrics::SEND_CALLS, 1);
+        _metrics.add(Metrics::BYTES_OUT, sent);
+        if(sent == 0) {
+            return false;
+        }
+        client.timers().last_write = _now;
+    }
+    return true;
+}
+
+void ChatWorker::recordSent(Connection& client, size_t sent)
+{
+    /*
+     * the receive-to-send delay is taken when the last byte of a stamped message leaves,
+     * messages older than the connection are a replayed backlog and are not accounted
+     */
+    const MessageQueue& outbound(client.outbound());
+    _metrics.add(Metrics::BYTES_OUT, sent);
+    if(sent > 0) {
+        client.timers().last_write = _now;
+    }
+    uint64_t now    = 0;
+    size_t   offset = outbound.offset();
+    for(size_t index = 0; index < outbound.size(); ++index) {
+        const Message& msg(*outbound.at(index));
+        const size_t   left = msg.size() - offset;
+        if(sent < left) {
+            break;
+        }
+        sent  -= left;
+        offset = 0;
+        if(msg.stamp() > client.connected_at()) {
+            now = (now != 0 ? now : Metrics::now());
+            _metrics.latency().record(now - msg.stamp());
+        }
+    }
+}
+
+void ChatWorker::armTimer(Connection& client, const unsigned kind, const uint64_t deadline)
+{
+    /* a timer without deadline is disabled */
+    if(deadline == 0) {
+        return;
+    }
+    Connection::Timers& timers(client.timers());
+    uint32_t* const     slots[] = {&timers.read, &timers.write, &timers.ping, &timers.resume};
+    uint32_t&           timer(*slots[kind]);
+    if(timer == TimerWheel::NONE) {
+        timer = _timers.arm(deadline, worker_timer(client.handle(), kind));
+    }
+    else {
+        _timers.rearm(timer, deadline);
+    }
+}
+
+void ChatWorker::expireTimers()
+{
+    /*
+     * activity does not touch the wheel, an expired timer compares the last activity
+     * with its deadline and is armed again if the connection was not actually idle
+     */
+    _now = worker_clock();
+    if(_timers.empty()) {
+        return;
+    }
+    _timers.expire(_now, _expired);
+    for(const uint64_t data : _expired) {
+        const unsigned         kind = (data & 3);
+        const ConnectionHandle handle{static_cast<int>((data & 0xffffffffULL) >> 2), static_cast<uint32_t>(data >> 32)};
+        Connection* client = _clients.find(handle);
+        if(client == nullptr) {
+            continue;
+        }
+        Connection::Timers& timers(client->timers());
+        if(kind == TIMER_READ) {
+            timers.read = TimerWheel::NONE;
+            const uint64_t deadline = readDeadline(*client);
+            if(client->closing() || (deadline == 0)) {
+                continue;
+            }
+            if(deadline <= _now) {
+                Logger::log(Logger::WARN, "Client %lld timed out, disconnecting", handle.fd, 0);
+                closeClient(*client);
+                continue;
+            }
+            armTimer(*client, TIMER_READ, deadline);
+        }
+        else if(kind == TIMER_PING) {
+            timers.ping = TimerWheel::NONE;
+            if(client->closing()) {
+                continue;
+            }
+            Connection::Heartbeat& heartbeat(client->heartbeat());
+            if((heartbeat.sent != 0) && (++heartbeat.missed >= _config.ping_misses) && (_config.ping_misses != 0)) {
+                Logger::log(Logger::WARN, "Client %lld missed %lld pings, disconnecting", handle.fd, heartbeat.missed);
+                closeClient(*client);
+                continue;
+            }
+            sendPing(*client);
+            armTimer(*client, TIMER_PING, _now + (_config.ping_interval * 1000ULL));
+        }
+        else if(kind == TIMER_RESUME) {
+            timers.resume = TimerWheel::NONE;
+            if(!client->closing()) {
+                resumeClient(*client);
+            }
+        }
+        else {
+            timers.write = TimerWheel::NONE;
+            const Connection::Catchup& catchup(client->catchup());
+            if(client->closing() || (client->outbound().empty() && (catchup.offset >= catchup.end))) {
+                continue;
+            }
+            const uint64_t deadline = timers.last_write + (_config.write_timeout * 1000ULL);
+            if(deadline <= _now) {
+                Logger::log(Logger::WARN, "Client %lld stopped reading, disconnecting", handle.fd, 0);
+                closeClient(*client);
+                continue;
+            }
+            armTimer(*client, TIMER_WRITE, deadline);
+        }
+    }
+    _expired.clear();
+}
+
+uint64_t ChatWorker::readDeadline(Connection& client) const
+{
+    /* until its first line a client is held to the handshake timeout, then to the idle timeout */
+    const Connection::Timers& timers(client.timers());
+    const uint64_t            connected = client.connected_at() / 1000000;
+    if((timers.last_read == 0) && (_config.handshake_timeout != 0)) {
+        return connected + (_config.handshake_timeout * 1000ULL);
+    }
+    if(_config.idle_timeout != 0) {
+        return std::max(timers.last_read, connected) + (_config.idle_timeout * 1000ULL);
+    }
+    return 0;
+}
+
+void ChatWorker::sendPing(Connection& client)
+{
+    /* a new ping supersedes an unanswered one, whose late pong is then ignored */
+    Connection::Heartbeat& heartbeat(client.heartbeat());
+    const std::string      text("* ping " + std::to_string(++heartbeat.token));
+    heartbeat.sent = Metrics::now();
+    _metrics.add(Metrics::PINGS, 1);
+    reply(client, text);
+}
+
+void ChatWorker::handlePong(Connection& client, const std::string& argument)
+{
+    /* "/pong token", the round trip includes the time the ping waited in the send queue */
+    Connection::Heartbeat& heartbeat(client.heartbeat());
+    char*                  last  = nullptr;
+    const unsigned long    token = ::strtoul(argument.c_str(), &last, 10);
+    if((heartbeat.sent == 0) || argument.empty() || (*last != '\0') || (token != heartbeat.token)) {
+        return;
+    }
+    const uint64_t rtt = Metrics::now() - heartbeat.sent;
+    heartbeat.srtt   = (heartbeat.srtt != 0 ? ((heartbeat.srtt * 7) + rtt) / 8 : rtt);
+    heartbeat.sent   = 0;
+    heartbeat.missed = 0;
+    _metrics.add(Metrics::PONGS, 1);
+    _metrics.rtt().record(rtt);
+}
+
+size_t ChatWorker::queueLimit(const Connection& client) const
+{
+    /* a client answering pings slower than the bound gets a queue shortened in proportion to its rtt */
+    const uint64_t srtt  = client.heartbeat().srtt;
+    const uint64_t bound = _config.rtt_limit * 1000000ULL;
+    if((bound == 0) || (srtt <= bound)) {
+        return _config.queue_limit;
+    }
+    return static_cast<size_t>(_config.queue_limit * (static_cast<double>(bound) / srtt));
+}
+
+unsigned ChatWorker::clientEvents(const Connection& client, const bool writable) const
+{
+    /* a paused client is not polled for input, the data left in its socket holds the flood back */
+    unsigned events = (writable ? EventLoop::EV_WRITE : 0);
+    if(!client.throttle().paused) {
+        events |= EventLoop::EV_READ;
+    }
+    if(!_event_loop->completions()) {
+        events |= EventLoop::EV_EDGE;
+    }
+    return events;
+}
+
+void ChatWorker::chargeClient(Connection& client, const double messages, const double bytes)
+{
+    /* every line handled is charged, the buckets may run into debt and the client is then paused until it is paid back */
+    if((_config.message_rate <= 0) && (_config.byte_rate <= 0)) {
+        return;
+    }
+    Connection::Throttle& throttle(client.throttle());
+    refillClient(client);
+    throttle.messages -= messages;
+    throttle.bytes    -= bytes;
+    const uint64_t delay = throttleDelay(client);
+    if(throttle.paused || (delay == 0)) {
+        return;
+    }
+    throttle.paused = true;
+    _metrics.add(Metrics::THROTTLES, 1);
+    _event_loop->modify(client.fd(), clientEvents(client, client.writing() && !_event_loop->completions()));
+    armTimer(client, TIMER_RESUME, _now + delay);
+}
+
+void ChatWorker::refillClient(Connection& client)
+{
+    Connection::Throttle& throttle(client.throttle());
+    const double          elapsed = (_now - throttle.stamp) / 1000.0;
+    throttle.stamp = _now;
+    if(_config.message_rate > 0) {
+        throttle.messages = std::min(worker_burst(_config.message_rate, _config.message_burst), throttle.messages + (elapsed * _config.message_rate));
+    }
+    if(_config.byte_rate > 0) {
+        throttle.bytes = std::min(worker_burst(_config.byte_rate, _config.byte_burst), throttle.bytes + (elapsed * _config.byte_rate));
+    }
+}
+
+uint64_t ChatWorker::throttleDelay(const Connection& client) const
+{
+    /* milliseconds until no bucket is in debt anymore */
+    const Connection::Throttle& throttle(client.throttle());
+    double                      delay = 0.0;
+    if((_config.message_rate > 0) && (throttle.messages < 0)) {
+        delay = std::max(delay, -throttle.messages / _config.message_rate);
+    }
+    if((_config.byte_rate > 0) && (throttle.bytes < 0)) {
+        delay = std::max(delay, -throttle.bytes / _config.byte_rate);
+    }
+    return static_cast<uint64_t>(std::ceil(delay * 1000.0));
+}
+
+void ChatWorker::resumeClient(Connection& client)
+{
+    refillClient(client);
+    const uint64_t delay = throttleDelay(client);
+    if(delay != 0) {
+        armTimer(client, TIMER_RESUME, _now + delay);
+        return;
+    }
+    /* the lines left over when it was paused come first, its socket is only read again once they are all handled */
+    client.throttle().paused = false;
+    if(!parseClient(client) || client.throttle().paused) {
+        return;
+    }
+    _event_loop->modify(client.fd(), clientEvents(client, client.writing() && !_event_loop->completions()));
+    if(!_event_loop->completions() && !client.backlogged()) {
+        client.set_backlogged(true);
+        _backlog.push_back(client.handle());
+    }
+}
+
+// ---------------------------------------------------------------------------
+// ChatServer
+// ---------------------------------------------------------------------------
+
+namespace {
+
+constexpr size_t handoff_batch = 64;
+
+sockaddr_un handoff_address(const std::string& path)
+{
+    sockaddr_un addr = {};
+    if(path.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("handoff path is too long");
+    }
+    addr.sun_family = AF_UNIX;
+    ::memcpy(addr.sun_path, path.data(), path.size());
+    return addr;
+}
+
+void handoff_send(const int fd, const std::vector<int>& fds)
+{
+    /* descriptors go by batches with their count, an empty batch ends the list */
+    size_t offset = 0;
+    while(true) {
+        uint32_t count = std::min(fds.size() - offset, handoff_batch);
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * handoff_batch)] = {};
+        iovec  iov = {&count, sizeof(count)};
+        msghdr msg = {};
+        msg.msg_iov    = &iov;
+        msg.msg_iovlen = 1;
+        if(count > 0) {
+            msg.msg_control    = control;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type  = SCM_RIGHTS;
+            cmsg->cmsg_len   = CMSG_LEN(sizeof(int) * count);
+            ::memcpy(CMSG_DATA(cmsg), fds.data() + offset, sizeof(int) * count);
+        }
+        if(::sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(count)) {
+            throw std::runtime_error("sendmsg() has failed");
+        }
+        if(count == 0) {
+            break;
+        }
+        offset += count;
+    }
+}
+
+void handoff_recv(const int fd, std::vector<int>& fds)
+{
+    while(true) {
+        uint32_t count = 0;
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * handoff_batch)] = {};
+        iovec  iov = {&count, sizeof(count)};
+        msghdr msg = {};
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+        const ssize_t rc = ::recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        for(cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS)) {
+                const size_t received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                for(size_t index = 0; index < received; ++index) {
+                    int value = -1;
+                    ::memcpy(&value, CMSG_DATA(cmsg) + (index * sizeof(int)), sizeof(int));
+                    fds.push_back(value);
+                }
+            }
+        }
+        if(rc != sizeof(count)) {
+            throw std::runtime_error("recvmsg() has failed");
+        }
+        if(count == 0) {
+            break;
+        }
+    }
+}
+
+std::vector<int> handoff_take(const std::string& path)
+{
+    /* a running server hands its listeners over as soon as its successor connects */
+    std::vector<int> fds;
+    if(path.empty()) {
+        return fds;
+    }
+    const sockaddr_un addr(handoff_address(path));
+    Socket channel(::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    if(channel.fd() < 0) {
+        throw std::runtime_error("socket() has failed");
+    }
+    if(::connect(channel.fd(), reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0) {
+        return fds;
+    }
+    const timeval timeout = {5, 0};
+    static_cast<void>(::setsockopt(channel.fd(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)));
+    try {
+        handoff_recv(channel.fd(), fds);
     }
     catch(...) {
-        const char* what("unhandled exception");
-        std::cerr << "error: " << what << std::endl;
-        return EXIT_FAILURE;
+        for(const int fd : fds) {
+            static_cast<void>(::close(fd));
+        }
+        throw;
+    }
+    return fds;
+}
+
+}
+
+ChatServer::ChatServer(const ChatConfig& config)
+    : SignalListener()
+    , EventListener()
+    , _config(config)
+    , _inherited(handoff_take(config.handoff))
+    , _signal_manager(*this)
+    , _console(config.max_line)
+    , _history(config.history.empty() ? nullptr : new MessageLog(config.history, config.history_segment, config.history_segments, 1024))
+    , _transcript(config.transcript.empty() ? nullptr : new Transcript(config.transcript, 64))
+    , _recent(config.recent)
+    , _admission(config.accept_rate > 0 ? new AdmissionFilter(config.accept_rate, (config.accept_burst > 0 ? config.accept_burst : config.accept_rate), 65536) : nullptr)
+    , _workers()
+    , _rooms_mutex()
+    , _room_ids()
+    , _nicks_mutex()
+    , _nicks()
+    , _metrics()
+    , _metrics_thread()
+    , _handoff()
+    , _handed_off(false)
+    , _draining(false)
+    , _quit(false)
+{
+    Logger::start(_config.log, _config.log_level);
+}
+
+ChatServer::~ChatServer()
+{
+    quit();
+    for(const int fd : _inherited) {
+        static_cast<void>(::close(fd));
+    }
+    if(_metrics_thread.joinable()) {
+        _metrics_thread.join();
+    }
+    _workers.clear();
+    Logger::stop();
+}
+
+void ChatServer::run(const uint32_t addr, const uint16_t port)
+{
+    const unsigned threads = std::max(_config.threads, 1U);
+
+    /* every worker owns a listener, the kernel shards connections between them */
+    for(unsigned index = 0; index < threads; ++index) {
+        _workers.emplace_back(new ChatWorker(*this, _config, index));
+        if(index < _inherited.size()) {
+            _workers.back()->adopt(_inherited[index]);
+        }
+        else {
+            _workers.back()->listen(addr, port, (threads > 1));
+        }
+    }
+    if(!_inherited.empty()) {
+        Logger::log(Logger::INFO, "Took over %lld listeners from the previous server", _inherited.size(), 0);
+        for(size_t index = threads; index < _inherited.size(); ++index) {
+            static_cast<void>(::close(_inherited[index]));
+        }
+        _inherited.clear();
+    }
+
+    /* the first worker runs on the calling thread and also serves stdin and signals */
+    ChatWorker& primary(*_workers.front());
+    Logger::log(Logger::INFO, "ChatServer::run() threads=%lld backend=", threads, 0, primary.loop().name());
+    try {
+        primary.loop().add(STDIN_FILENO, EventLoop::EV_READ, *this);
+    }
+    catch(const std::exception& e) {
+        /* epoll refuses regular files such as /dev/null */
+        Logger::log(Logger::WARN, "stdin is not pollable, console disabled", 0, 0);
+    }
+    primary.loop().add(_signal_manager.fd(), EventLoop::EV_READ, *this);
+    if(!_config.handoff.empty()) {
+        offerHandoff();
+    }
+
+    /* the exporter has its own thread and a loopback port, scrapes never touch the workers' loops */
+    if(_config.metrics != 0) {
+        _metrics.create();
+        _metrics.set_reuseaddr(true);
+        _metrics.set_reuseport(true);
+        _metrics.set_nonblock(true);
+        _metrics.bind(INADDR_LOOPBACK, _config.metrics);
+        _metrics.listen(16);
+        _metrics_thread = std::thread(&ChatServer::serveMetrics, this);
+    }
+
+    for(auto& worker : _workers) {
+        if(worker.get() != &primary) {
+            worker->start();
+        }
+    }
+    primary.run();
+    for(auto& worker : _workers) {
+        worker->join();
+    }
+    closeHandoff(true);
+    _quit = true;
+    if(_metrics_thread.joinable()) {
+        _metrics_thread.join();
+    }
+}
+
+void ChatServer::broadcast(ChatWorker& origin, const int sender, const MessagePtr& msg, const uint32_t room)
+{
+    /* only public traffic is logged, room members and private messages are not replayed to others */
+    const bool logged = ((room == 0) && !_handed_off);
+    if(logged && _history) {
+        _history->append(*msg);
+    }
+    if(logged && _transcript) {
+        _transcript->append(msg);
+    }
+    if(room == 0) {
+        _recent.push(msg);
+    }
+    for(auto& worker : _workers) {
+        if(worker.get() == &origin) {
+            worker->deliver(msg, room, sender);
+        }
+        else {
+            worker->post(msg, room);
+        }
+    }
+}
+
+uint32_t ChatServer::room(const std::string& name, const bool create)
+{
+    /* identifiers are never recycled, 0 stands for messages addressed to everybody */
+    const std::lock_guard<std::mutex> lock(_rooms_mutex);
+    auto it = _room_ids.find(name);
+    if(it != _room_ids.end()) {
+        return it->second;
+    }
+    if(!create || (_room_ids.size() >= 65536)) {
+        return 0;
+    }
+    const uint32_t room = _room_ids.size() + 1;
+    _room_ids.emplace(name, room);
+    return room;
+}
+
+bool ChatServer::registerNick(const std::string& nick, ChatWorker& worker, const ConnectionHandle& handle)
+{
+    const std::lock_guard<std::mutex> lock(_nicks_mutex);
+    return _nicks.emplace(nick, NickOwner{&worker, handle}).second;
+}
+
+void ChatServer::releaseNick(const std::string& nick, ChatWorker& worker, const ConnectionHandle& handle)
+{
+    /* only the owner may release a nickname, it may have been claimed again since */
+    const std::lock_guard<std::mutex> lock(_nicks_mutex);
+    auto it = _nicks.find(nick);
+    if(it != _nicks.end()) {
+        const NickOwner& owner(it->second);
+        if((owner.worker == &worker) && (owner.handle.fd == handle.fd) && (owner.handle.generation == handle.generation)) {
+            _nicks.erase(it);
+        }
+    }
+}
+
+bool ChatServer::history(const size_t count, std::vector<MessagePtr>& result)
+{
+    if(!_history) {
+        return false;
+    }
+    _history->replay(count, result);
+    return true;
+}
+
+Transcript* ChatServer::transcript()
+{
+    return _transcript.get();
+}
+
+void ChatServer::recent(std::vector<MessagePtr>& result)
+{
+    _recent.snapshot(result);
+}
+
+bool ChatServer::admit(const uint32_t addr)
+{
+    return !_admission || _admission->admit(addr, Metrics::now());
+}
+
+bool ChatServer::sendPrivate(ChatWorker& origin, const std::string& nick, const MessagePtr& msg)
+{
+    NickOwner owner = {};
+    {
+        const std::lock_guard<std::mutex> lock(_nicks_mutex);
+        auto it = _nicks.find(nick);
+        if(it == _nicks.end()) {
+            return false;
+        }
+        owner = it->second;
     }
-    return EXIT_SUCCESS;
+    if(owner.worker == &origin) {
+        owner.worker->deliver(msg, owner.handle);
+    }
+    else {
+        owner.worker->post(msg, owner.handle);
+    }
+    return true;
+}
+
+void ChatServer::onReadable(const int fd)
+{
+    if(_quit) {
+        return;
+    }
+    if(fd == _signal_manager.fd()) {
+        _signal_manager.dispatch();
+    }
+    else if(fd == STDIN_FILENO) {
+        readStdin();
+    }
+    else if(fd == _handoff.fd()) {
+        handOff();
+    }
+}
+
+void ChatServer::readStdin()
+{
+    ChatWorker& primary(*_workers.front());
+
+    _console.reserve(4096);
+    const ssize_t bytes_read = ::read(STDIN_FILENO, _console.tail(), _console.room());
+    if(bytes_read <= 0) {
+        if((bytes_read < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+            return;
+        }
+        Logger::log(Logger::WARN, "Error reading from stdin", 0, 0);
+        primary.loop().remove(STDIN_FILENO);
+        return;
+    }
+    _console.commit(bytes_read);
+
+    const char* line   = nullptr;
+    size_t      length = 0;
+    while(!_quit && _console.next(line, length)) {
+        handleCommand(line, length);
+    }
+    if(_console.overflow()) {
+        Logger::log(Logger::WARN, "Error reading from stdin", 0, 0);
+        primary.loop().remove(STDIN_FILENO);
+    }
+}
+
+void ChatServer::handleCommand(const char* line, const size_t length)
+{
+    const std::string input(line, length);
+
+    if (input == "quit") {
+        quit();
+    }
+    else if (input == "drain") {
+        drain();
+    }
+    else if (!input.empty()) {
+        broadcast(*_workers.front(), -1, Message::create_line(line, length), 0);
+    }
+}
+
+void ChatServer::serveMetrics()
+{
+    std::string request;
+    std::string response;
+    std::string body;
+    while(!_quit) {
+        pollfd entry = {_metrics.fd(), POLLIN, 0};
+        if(::poll(&entry, 1, 250) <= 0) {
+            continue;
+        }
+        try {
+            const int fd = _metrics.accept();
+            if(fd < 0) {
+                continue;
+            }
+            Socket client(fd);
+            const timeval timeout = {1, 0};
+            static_cast<void>(::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)));
+            static_cast<void>(::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)));
+            /* the request is read up to its blank line and otherwise ignored, any path gets the metrics */
+            char buffer[1024];
+            request.clear();
+            while((request.size() < 8192) && (request.find("\r\n\r\n") == std::string::npos) && (request.find("\n\n") == std::string::npos)) {
+                const ssize_t rc = ::recv(fd, buffer, sizeof(buffer), 0);
+                if(rc <= 0) {
+                    break;
+                }
+                request.append(buffer, rc);
+            }
+            body.clear();
+            exportMetrics(body);
+            response = "HTTP/1.0 200 OK\r\n"
+                       "Content-Type: text/plain; version=0.0.4\r\n"
+                       "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                       "Connection: close\r\n"
+                       "\r\n" + body;
+            size_t offset = 0;
+            while(offset < response.size()) {
+                const size_t sent = client.send(response.data() + offset, response.size() - offset);
+                if(sent == 0) {
+                    break;
+                }
+                offset += sent;
+            }
+        }
+        catch(const std::exception& e) {
+            Logger::log(Logger::WARN, "", 0, 0, e.what());
+        }
+    }
+}
+
+void ChatServer::exportMetrics(std::string& result)
+{
+    /* counters are labelled by worker, the histograms of the workers are merged into one summary each */
+    for(unsigned counter = 0; counter < Metrics::COUNTERS; ++counter) {
+        const std::string name(std::string("chat_") + Metrics::name(static_cast<Metrics::Counter>(counter)) + "_total");
+        result += "# TYPE " + name + " counter\n";
+        for(const auto& worker : _workers) {
+            result += name + "{worker=\"" + std::to_string(worker->index()) + "\"} "
+                    + std::to_string(worker->metrics().get(static_cast<Metrics::Counter>(counter))) + '\n';
+        }
+    }
+    auto summary = [&](const char* name, const Histogram& (Metrics::*histogram)() const) -> void
+    {
+        std::unique_ptr<Histogram> merged(new Histogram());
+        for(const auto& worker : _workers) {
+            merged->merge((worker->metrics().*histogram)());
+        }
+        char line[128];
+        result += std::string("# TYPE ") + name + " summary\n";
+        for(const double quantile : {0.5, 0.9, 0.99, 0.999}) {
+            static_cast<void>(::snprintf(line, sizeof(line), "%s{quantile=\"%g\"} %.9f\n", name, quantile, merged->percentile(quantile) / 1e9));
+            result += line;
+        }
+        static_cast<void>(::snprintf(line, sizeof(line), "%s_sum %.9f\n", name, merged->sum() / 1e9));
+        result += line;
+        result += std::string(name) + "_count " + std::to_string(merged->count()) + '\n';
+    };
+
+    summary("chat_delivery_latency_seconds", &Metrics::latency);
+    summary("chat_rtt_seconds", &Metrics::rtt);
+}
+
+void ChatServer::cont()
+{
+    /* the status goes through the logger like every other message */
+    std::ostringstream stream;
+    for(auto& worker : _workers) {
+        worker->dump(stream);
+    }
+    MemoryPool::dump(stream);
+    Logger::log_lines(Logger::INFO, stream.str());
+}
+
+void ChatServer::offerHandoff()
+{
+    /* a stale socket left by a crashed server is replaced */
+    const sockaddr_un addr(handoff_address(_config.handoff));
+    static_cast<void>(::unlink(_config.handoff.c_str()));
+    _handoff.reset(::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+    if(_handoff.fd() < 0) {
+        throw std::runtime_error("socket() has failed");
+    }
+    if(::bind(_handoff.fd(), reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0) {
+        throw std::runtime_error("bind() has failed");
+    }
+    _handoff.listen(1);
+    _workers.front()->loop().add(_handoff.fd(), EventLoop::EV_READ, *this);
+}
+
+void ChatServer::handOff()
+{
+    /*
+     * the successor gets every listener with the connections still waiting in their
+     * accept queues, and takes over the logs once this server stops appending to them
+     */
+    const int fd = _handoff.accept();
+    if(fd < 0) {
+        return;
+    }
+    Socket           channel(fd);
+    std::vector<int> listeners;
+    for(const auto& worker : _workers) {
+        if(worker->listener() >= 0) {
+            listeners.push_back(worker->listener());
+        }
+    }
+    _handed_off = true;
+    if(_transcript) {
+        _transcript->flush();
+    }
+    try {
+        const timeval timeout = {5, 0};
+        static_cast<void>(::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)));
+        handoff_send(fd, listeners);
+    }
+    catch(const std::exception& e) {
+        _handed_off = false;
+        Logger::log(Logger::WARN, "", 0, 0, e.what());
+        return;
+    }
+    Logger::log(Logger::INFO, "Handed %lld listeners over to the next server", listeners.size(), 0);
+    closeHandoff(false);
+    drain();
+}
+
+void ChatServer::closeHandoff(const bool unlink)
+{
+    if(_handoff.fd() >= 0) {
+        _workers.front()->loop().remove(_handoff.fd());
+        _handoff.close();
+        if(unlink) {
+            static_cast<void>(::unlink(_config.handoff.c_str()));
+        }
+    }
+}
+
+void ChatServer::drain()
+{
+    /* a second request, or a quit, ends the drain at once */
+    if(_draining.exchange(true)) {
+        quit();
+        return;
+    }
+    Logger::log(Logger::INFO, "Draining, %lld seconds at most", _config.drain_timeout, 0);
+    closeHandoff(true);
+    for(auto& worker : _workers) {
+        worker->drain();
+    }
+}
+
+void ChatServer::quit()
+{
+    _quit = true;
+    for(auto& worker : _workers) {
+        worker->stop();
+    }
+}
+
+void ChatServer::onSigHgup()
+{
+    Logger::log(Logger::INFO, "SIGHGUP", 0, 0);
+    /* with a log file, a hangup is a request to reopen it after rotation */
+    if(!_config.log.empty()) {
+        Logger::reopen();
+        return;
+    }
+    quit();
+}
+
+void ChatServer::onSigIntr()
+{
+    Logger::log(Logger::INFO, "SIGINTR", 0, 0);
+    quit();
+}
+
+void ChatServer::onSigTerm()
+{
+    Logger::log(Logger::INFO, "SIGTERM", 0, 0);
+    drain();
+}
+
+void ChatServer::onSigPipe()
+{
+    Logger::log(Logger::INFO, "SIGPIPE", 0, 0);
+    quit();
+}
+
+void ChatServer::onSigChld()
+{
+    Logger::log(Logger::INFO, "SIGCHLD", 0, 0);
+    quit();
+}
+
+void ChatServer::onSigAlrm()
+{
+    Logger::log(Logger::INFO, "SIGALRM", 0, 0);
+    cont();
+}
+
+void ChatServer::onSigUsr1()
+{
+    Logger::log(Logger::INFO, "SIGUSR1", 0, 0);
+    cont();
+}
+
+void ChatServer::onSigUsr2()
+{
+    Logger::log(Logger::INFO, "SIGUSR2", 0, 0);
+    cont();
 }
 
 // ---------------------------------------------------------------------------
@@ -237,13 +237,28 @@ class SignalManager
 public:
     SignalManager(SignalListener& listener);
 
-    virtual ~SignalManager() = default;
+    SignalManager(const SignalManager&) = delete;
+
+    SignalManager& operator=(const SignalManager&) = delete;
+
+    virtual ~SignalManager();
 
     virtual bool timedwait(const unsigned long timeout);
 
+    virtual bool dispatch();
+
+    int fd() const
+    {
+        return _sigfd;
+    }
+
+protected:
+    void notify(const int signum);
+
 protected:
     SignalListener&  _listener;
     posix::sigset    _sigmask;
+    int              _sigfd;
     posix::sigaction _sighgup;
     posix::sigaction _sigintr;
     posix::sigaction _sigterm;
@@ -294,6 +309,16 @@ public:
         return sizeof(_endpoint);
     }
 
+    auto addr() const -> uint32_t
+    {
+        return ntohl(_endpoint.sin_addr.s_addr);
+    }
+
+    auto port() const -> uint16_t
+    {
+        return ntohs(_endpoint.sin_port);
+    }
+
 private:
     SockAddrIn _endpoint;
 };
@@ -309,6 +334,25 @@ public:
 
     Socket(const int fd);
 
+    Socket(const Socket&) = delete;
+
+    Socket(Socket&& other) noexcept
+        : _fd(other._fd)
+    {
+        other._fd = -1;
+    }
+
+    Socket& operator=(const Socket&) = delete;
+
+    Socket& operator=(Socket&& other)
+    {
+        if(this != &other) {
+            reset(other._fd);
+            other._fd = -1;
+        }
+        return *this;
+    }
+
     virtual ~Socket();
 
     int fd() const
@@ -333,7 +377,17 @@ public:
 
     int  accept();
 
-    void send(const std::string&);
+    int  accept(EndPoint& peer);
+
+    void set_nonblock(const bool value) const;
+
+    size_t send(const std::string&);
+
+    size_t send(const char* data, const size_t size);
+
+    size_t send(const iovec* iov, const size_t count);
+
+    size_t send_file(const int fd, off_t& offset, const size_t count);
 
     void recv(std::string&);
 
@@ -347,6 +401,10 @@ public:
 
     void set_reuseaddr(const bool value) const;
 
+    bool get_reuseport() const;
+
+    void set_reuseport(const bool value) const;
+
     int  get_sndbuf() const;
 
     void set_sndbuf(const int value) const;
@@ -360,49 +418,1771 @@ protected:
 };
 
 // ---------------------------------------------------------------------------
-// ChatServer
+// MemoryPool
 // ---------------------------------------------------------------------------
 
-class ChatServer final
-    : protected SignalListener
+class MemoryPool
 {
 public:
-    ChatServer();
+    static constexpr size_t MIN_BLOCK = 64;
+    static constexpr size_t MAX_BLOCK = 16384;
 
-    virtual ~ChatServer() = default;
+    static void* allocate(const size_t size);
 
-    void run(const uint32_t addr, const uint16_t port);
+    static void deallocate(void* block, const size_t size);
+
+    static uint64_t heap_allocations();
+
+    static uint64_t pool_allocations();
+
+    static void dump(std::ostream& stream);
+};
+
+// ---------------------------------------------------------------------------
+// PoolAllocator
+// ---------------------------------------------------------------------------
+
+template <typename T>
+class PoolAllocator
+{
+public:
+    using value_type = T;
+
+    PoolAllocator() = default;
+
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>&)
+    {
+    }
+
+    T* allocate(const size_t count)
+    {
+        return static_cast<T*>(MemoryPool::allocate(count * sizeof(T)));
+    }
+
+    void deallocate(T* pointer, const size_t count)
+    {
+        MemoryPool::deallocate(pointer, count * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const PoolAllocator<U>&) const
+    {
+        return true;
+    }
+
+    template <typename U>
+    bool operator!=(const PoolAllocator<U>&) const
+    {
+        return false;
+    }
+};
+
+// ---------------------------------------------------------------------------
+// Logger
+// ---------------------------------------------------------------------------
+
+class Logger
+{
+public:
+    enum Level : uint8_t
+    {
+        DEBUG,
+        INFO,
+        WARN,
+        ERROR,
+    };
+
+    static void start(const std::string& path, const Level level);
+
+    static void stop();
+
+    static void reopen();
+
+    static void log(const Level level, const char* format, const int64_t arg0, const int64_t arg1);
+
+    static void log(const Level level, const char* format, const int64_t arg0, const int64_t arg1, const char* text);
+
+    static void log(const Level level, const char* format, const int64_t arg0, const int64_t arg1, const char* text, const size_t length);
+
+    static void log_lines(const Level level, const std::string& text);
+
+    static uint64_t dropped();
+
+    static Level level(const std::string& name);
+};
+
+// ---------------------------------------------------------------------------
+// SharedRegion
+// ---------------------------------------------------------------------------
+
+class SharedRegion
+{
+public:
+    SharedRegion()
+        : _refs(0)
+    {
+    }
+
+    SharedRegion(const SharedRegion&) = delete;
+
+    SharedRegion& operator=(const SharedRegion&) = delete;
+
+    void retain() const
+    {
+        _refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void release() const
+    {
+        if(_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete this;
+        }
+    }
 
 protected:
-    virtual void onSigHgup() override;
+    virtual ~SharedRegion() = default;
 
-    virtual void onSigIntr() override;
+private:
+    mutable std::atomic<unsigned> _refs;
+};
 
-    virtual void onSigTerm() override;
+// ---------------------------------------------------------------------------
+// Message
+// ---------------------------------------------------------------------------
 
-    virtual void onSigPipe() override;
+class MessagePtr;
 
-    virtual void onSigChld() override;
+class Message
+{
+public:
+    Message(const Message&) = delete;
 
-    virtual void onSigAlrm() override;
+    Message& operator=(const Message&) = delete;
 
-    virtual void onSigUsr1() override;
+    static auto create(const char* data, const size_t size) -> MessagePtr;
 
-    virtual void onSigUsr2() override;
+    static auto create(const std::string& string) -> MessagePtr;
+
+    static auto create_line(const char* data, const size_t size) -> MessagePtr;
+
+    static auto create_line(const char* data, const size_t size, const uint64_t stamp) -> MessagePtr;
+
+    static auto create_view(const SharedRegion& region, const char* data, const size_t size) -> MessagePtr;
+
+    const char* data() const
+    {
+        return _data;
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+    uint64_t stamp() const
+    {
+        return _stamp;
+    }
+
+    void retain() const
+    {
+        _refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void release() const
+    {
+        if(_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            destroy(this);
+        }
+    }
 
 private:
-    void cont();
+    Message(const char* data, const size_t size, const SharedRegion* region, const uint64_t stamp)
+        : _refs(0)
+        , _size(size)
+        , _data(data)
+        , _region(region)
+        , _stamp(stamp)
+    {
+    }
 
-    void quit();
+    ~Message() = default;
 
-    void sendMsgToClient(Socket &client, std::string msg);
+    static void destroy(const Message* message);
 
 private:
-    SignalManager _signal_manager;
-    Socket        _server;
-    std::list<Socket>       _clients;
-    bool          _quit;
-    std::vector<pollfd> _pollfds;
+    mutable std::atomic<unsigned> _refs;
+    const size_t                  _size;
+    const char* const             _data;
+    const SharedRegion* const     _region;
+    const uint64_t                _stamp;
+};
+
+// ---------------------------------------------------------------------------
+// MessagePtr
+// ---------------------------------------------------------------------------
+
+class MessagePtr
+{
+public:
+    MessagePtr()
+        : _message(nullptr)
+    {
+    }
+
+    explicit MessagePtr(const Message* message)
+        : _message(message)
+    {
+        if(_message != nullptr) {
+            _message->retain();
+        }
+    }
+
+    MessagePtr(const MessagePtr& other)
+        : MessagePtr(other._message)
+    {
+    }
+
+    MessagePtr(MessagePtr&& other) noexcept
+        : _message(other._message)
+    {
+        other._message = nullptr;
+    }
+
+    ~MessagePtr()
+    {
+        reset();
+    }
+
+    MessagePtr& operator=(MessagePtr other) noexcept
+    {
+        std::swap(_message, other._message);
+        return *this;
+    }
+
+    const Message* operator->() const
+    {
+        return _message;
+    }
+
+    const Message& operator*() const
+    {
+        return *_message;
+    }
+
+    explicit operator bool() const
+    {
+        return _message != nullptr;
+    }
+
+    void reset()
+    {
+        if(_message != nullptr) {
+            _message = (_message->release(), nullptr);
+        }
+    }
+
+private:
+    const Message* _message;
+};
+
+// ---------------------------------------------------------------------------
+// MessageQueue
+// ---------------------------------------------------------------------------
+
+class MessageQueue
+{
+public:
+    MessageQueue()
+        : _ring()
+        , _head(0)
+        , _count(0)
+        , _offset(0)
+        , _bytes(0)
+        , _pinned(0)
+    {
+    }
+
+    bool empty() const
+    {
+        return _count == 0;
+    }
+
+    size_t size() const
+    {
+        return _count;
+    }
+
+    size_t bytes() const
+    {
+        return _bytes;
+    }
+
+    size_t offset() const
+    {
+        return _offset;
+    }
+
+    const MessagePtr& front() const
+    {
+        return _ring[_head];
+    }
+
+    const MessagePtr& at(const size_t index) const
+    {
+        return _ring[(_head + index) & (_ring.size() - 1)];
+    }
+
+    void pin(const size_t count)
+    {
+        _pinned = count;
+    }
+
+    void unpin()
+    {
+        _pinned = 0;
+    }
+
+    void push_back(const MessagePtr& msg);
+
+    size_t gather(iovec* iov, const size_t count) const;
+
+    size_t consume(size_t size);
+
+    bool drop_oldest(size_t& position);
+
+    void clear();
+
+private:
+    using Ring = std::vector<MessagePtr, PoolAllocator<MessagePtr>>;
+
+    Ring                    _ring;
+    size_t                  _head;
+    size_t                  _count;
+    size_t                  _offset;
+    size_t                  _bytes;
+    size_t                  _pinned;
+};
+
+// ---------------------------------------------------------------------------
+// MessageRing
+// ---------------------------------------------------------------------------
+
+class MessageRing
+{
+public:
+    MessageRing(const size_t capacity)
+        : _mutex()
+        , _ring(capacity)
+        , _head(0)
+        , _count(0)
+    {
+    }
+
+    MessageRing(const MessageRing&) = delete;
+
+    MessageRing& operator=(const MessageRing&) = delete;
+
+    virtual ~MessageRing() = default;
+
+    void push(const MessagePtr& msg);
+
+    void snapshot(std::vector<MessagePtr>& result);
+
+private:
+    std::mutex              _mutex;
+    std::vector<MessagePtr> _ring;
+    size_t                  _head;
+    size_t                  _count;
+};
+
+// ---------------------------------------------------------------------------
+// AdmissionFilter
+// ---------------------------------------------------------------------------
+
+class AdmissionFilter
+{
+public:
+    AdmissionFilter(const double rate, const double burst, const size_t limit);
+
+    AdmissionFilter(const AdmissionFilter&) = delete;
+
+    AdmissionFilter& operator=(const AdmissionFilter&) = delete;
+
+    virtual ~AdmissionFilter() = default;
+
+    bool admit(const uint32_t addr, const uint64_t now);
+
+    size_t size();
+
+private:
+    using Order = std::list<uint32_t>;
+
+    struct Bucket
+    {
+        double          tokens;
+        uint64_t        stamp;
+        Order::iterator position;
+    };
+
+    void sweep(const uint64_t now);
+
+private:
+    const double                         _rate;
+    const double                         _burst;
+    const size_t                         _limit;
+    std::mutex                           _mutex;
+    std::unordered_map<uint32_t, Bucket> _buckets;
+    Order                                _order;
+    uint64_t                             _swept;
+};
+
+// ---------------------------------------------------------------------------
+// MessageLog
+// ---------------------------------------------------------------------------
+
+class MessageLog
+{
+public:
+    MessageLog(const std::string& directory, const size_t segment_size, const size_t max_segments, const size_t max_replay);
+
+    MessageLog(const MessageLog&) = delete;
+
+    MessageLog& operator=(const MessageLog&) = delete;
+
+    virtual ~MessageLog();
+
+    uint64_t append(const Message& msg);
+
+    void replay(const size_t count, std::vector<MessagePtr>& result);
+
+    void sync();
+
+private:
+    struct Record
+    {
+        uint64_t sequence;
+        uint64_t timestamp;
+        uint32_t size;
+        uint32_t reserved;
+    };
+
+    class Segment final
+        : public SharedRegion
+    {
+    public:
+        Segment(const std::string& path, const uint64_t first, const size_t capacity);
+
+        char* base() const
+        {
+            return _base;
+        }
+
+        size_t capacity() const
+        {
+            return _capacity;
+        }
+
+        uint64_t first() const
+        {
+            return _first;
+        }
+
+        void sync(const size_t used, const bool wait);
+
+        void truncate(const size_t used);
+
+    private:
+        virtual ~Segment();
+
+    private:
+        int      _fd;
+        char*    _base;
+        size_t   _capacity;
+        size_t   _synced;
+        uint64_t _first;
+    };
+
+    struct Position
+    {
+        const Segment* segment;
+        size_t         offset;
+    };
+
+    void recover();
+
+    auto rotate() -> Segment*;
+
+    void retire();
+
+private:
+    std::mutex           _mutex;
+    const std::string    _directory;
+    const size_t         _segment_size;
+    const size_t         _max_segments;
+    const size_t         _max_replay;
+    std::deque<Segment*> _segments;
+    std::deque<Position> _index;
+    size_t               _used;
+    uint64_t             _sequence;
+    uint64_t             _synced_at;
+};
+
+// ---------------------------------------------------------------------------
+// Transcript
+// ---------------------------------------------------------------------------
+
+class Transcript
+{
+public:
+    Transcript(const std::string& path, const size_t stride);
+
+    Transcript(const Transcript&) = delete;
+
+    Transcript& operator=(const Transcript&) = delete;
+
+    virtual ~Transcript();
+
+    struct Range
+    {
+        off_t    offset;
+        off_t    end;
+        uint64_t last;
+    };
+
+    int fd() const
+    {
+        return _fd;
+    }
+
+    void append(const MessagePtr& msg);
+
+    void flush();
+
+    bool locate(const uint64_t sequence, Range& range);
+
+    bool seek(const off_t offset, Range& range);
+
+private:
+    void recover();
+
+    void run();
+
+    bool write();
+
+    off_t skip(off_t offset, size_t lines) const;
+
+private:
+    std::mutex              _mutex;
+    const size_t            _stride;
+    int                     _fd;
+    off_t                   _size;
+    uint64_t                _count;
+    std::vector<off_t>      _index;
+    std::vector<MessagePtr> _queue;
+    std::vector<MessagePtr> _batch;
+    std::vector<iovec>      _iovecs;
+    std::atomic<size_t>     _queued;
+    std::atomic<size_t>     _written;
+    std::atomic<bool>       _stopping;
+    std::thread             _thread;
+};
+
+// ---------------------------------------------------------------------------
+// LineScanner
+// ---------------------------------------------------------------------------
+
+class LineScanner
+{
+public:
+    using Function = const char* (*)(const char* begin, const char* end);
+
+    static const char* find(const char* begin, const char* end)
+    {
+        return _function(begin, end);
+    }
+
+    static const char* name();
+
+    static bool has_sse2();
+
+    static bool has_avx2();
+
+    static const char* find_naive(const char* begin, const char* end);
+
+    static const char* find_memchr(const char* begin, const char* end);
+
+    static const char* find_sse2(const char* begin, const char* end);
+
+    static const char* find_avx2(const char* begin, const char* end);
+
+private:
+    static Function select();
+
+    static const Function _function;
+};
+
+// ---------------------------------------------------------------------------
+// LineFramer
+// ---------------------------------------------------------------------------
+
+class LineFramer
+{
+public:
+    LineFramer(const size_t max_length)
+        : _buffer()
+        , _head(0)
+        , _tail(0)
+        , _scan(0)
+        , _max_length(max_length)
+        , _overflow(false)
+    {
+    }
+
+    char* tail()
+    {
+        return _buffer.data() + _tail;
+    }
+
+    size_t room() const
+    {
+        return _buffer.size() - _tail;
+    }
+
+    void commit(const size_t size)
+    {
+        _tail += size;
+    }
+
+    bool overflow() const
+    {
+        return _overflow || ((_tail - _head) > _max_length);
+    }
+
+    void reserve(const size_t size);
+
+    bool next(const char*& line, size_t& length);
+
+private:
+    using Buffer = std::vector<char, PoolAllocator<char>>;
+
+    Buffer            _buffer;
+    size_t            _head;
+    size_t            _tail;
+    size_t            _scan;
+    size_t            _max_length;
+    bool              _overflow;
+};
+
+// ---------------------------------------------------------------------------
+// ConnectionHandle
+// ---------------------------------------------------------------------------
+
+struct ConnectionHandle
+{
+    int      fd;
+    uint32_t generation;
+};
+
+// ---------------------------------------------------------------------------
+// Connection
+// ---------------------------------------------------------------------------
+
+class Connection
+{
+public:
+    Connection(const int fd, const size_t max_line, const uint32_t generation);
+
+    Connection(const Connection&) = delete;
+
+    Connection(Connection&&) = default;
+
+    Connection& operator=(const Connection&) = delete;
+
+    Connection& operator=(Connection&&) = default;
+
+    virtual ~Connection() = default;
+
+    struct Catchup
+    {
+        off_t  offset;
+        off_t  end;
+        size_t barrier;
+    };
+
+    struct Timers
+    {
+        uint32_t read;
+        uint32_t write;
+        uint32_t ping;
+        uint32_t resume;
+        uint64_t last_read;
+        uint64_t last_write;
+    };
+
+    struct Heartbeat
+    {
+        uint32_t token;
+        uint32_t missed;
+        uint64_t sent;
+        uint64_t srtt;
+    };
+
+    struct Throttle
+    {
+        double   messages;
+        double   bytes;
+        uint64_t stamp;
+        bool     paused;
+    };
+
+    int fd() const
+    {
+        return _socket.fd();
+    }
+
+    uint32_t generation() const
+    {
+        return _generation;
+    }
+
+    ConnectionHandle handle() const
+    {
+        return ConnectionHandle{_socket.fd(), _generation};
+    }
+
+    Socket& socket()
+    {
+        return _socket;
+    }
+
+    LineFramer& inbound()
+    {
+        return _inbound;
+    }
+
+    MessageQueue& outbound()
+    {
+        return _outbound;
+    }
+
+    bool writing() const
+    {
+        return _writing;
+    }
+
+    void set_writing(const bool writing)
+    {
+        _writing = writing;
+    }
+
+    bool pending() const
+    {
+        return _pending;
+    }
+
+    void set_pending(const bool pending)
+    {
+        _pending = pending;
+    }
+
+    bool backlogged() const
+    {
+        return _backlogged;
+    }
+
+    void set_backlogged(const bool backlogged)
+    {
+        _backlogged = backlogged;
+    }
+
+    bool closing() const
+    {
+        return _closing;
+    }
+
+    void set_closing(const bool closing)
+    {
+        _closing = closing;
+    }
+
+    std::vector<uint32_t>& rooms()
+    {
+        return _rooms;
+    }
+
+    const std::string& nickname() const
+    {
+        return _nickname;
+    }
+
+    void set_nickname(const std::string& nickname)
+    {
+        _nickname = nickname;
+    }
+
+    Catchup& catchup()
+    {
+        return _catchup;
+    }
+
+    Timers& timers()
+    {
+        return _timers;
+    }
+
+    Heartbeat& heartbeat()
+    {
+        return _heartbeat;
+    }
+
+    const Heartbeat& heartbeat() const
+    {
+        return _heartbeat;
+    }
+
+    Throttle& throttle()
+    {
+        return _throttle;
+    }
+
+    const Throttle& throttle() const
+    {
+        return _throttle;
+    }
+
+    uint64_t connected_at() const
+    {
+        return _connected_at;
+    }
+
+    void set_connected_at(const uint64_t connected_at)
+    {
+        _connected_at = connected_at;
+    }
+
+private:
+    Socket                _socket;
+    LineFramer            _inbound;
+    MessageQueue          _outbound;
+    std::vector<uint32_t> _rooms;
+    std::string           _nickname;
+    Catchup               _catchup;
+    Timers                _timers;
+    Heartbeat             _heartbeat;
+    Throttle              _throttle;
+    uint64_t              _connected_at;
+    uint32_t              _generation;
+    bool                  _writing;
+    bool                  _pending;
+    bool                  _backlogged;
+    bool                  _closing;
+};
+
+// ---------------------------------------------------------------------------
+// ConnectionTable
+// ---------------------------------------------------------------------------
+
+class ConnectionTable
+{
+public:
+    ConnectionTable()
+        : _connections()
+        , _slots()
+    {
+    }
+
+    bool empty() const
+    {
+        return _connections.empty();
+    }
+
+    size_t size() const
+    {
+        return _connections.size();
+    }
+
+    Connection& operator[](const size_t index)
+    {
+        return _connections[index];
+    }
+
+    Connection* find(const int fd)
+    {
+        if((fd >= 0) && (static_cast<size_t>(fd) < _slots.size())) {
+            const int32_t index = _slots[fd].index;
+            if(index >= 0) {
+                return &_connections[index];
+            }
+        }
+        return nullptr;
+    }
+
+    Connection* find(const ConnectionHandle& handle)
+    {
+        Connection* connection = find(handle.fd);
+        if((connection != nullptr) && (connection->generation() == handle.generation)) {
+            return connection;
+        }
+        return nullptr;
+    }
+
+    Connection& insert(const int fd, const size_t max_line);
+
+    void erase(const int fd);
+
+    void clear();
+
+private:
+    struct Slot
+    {
+        int32_t  index;
+        uint32_t generation;
+    };
+
+    std::vector<Connection> _connections;
+    std::vector<Slot>       _slots;
+};
+
+// ---------------------------------------------------------------------------
+// RoomTable
+// ---------------------------------------------------------------------------
+
+class RoomTable
+{
+public:
+    using Subscribers = std::vector<ConnectionHandle>;
+
+    RoomTable()
+        : _rooms()
+    {
+    }
+
+    size_t size() const
+    {
+        return _rooms.size();
+    }
+
+    const Subscribers* find(const uint32_t room) const
+    {
+        auto it = _rooms.find(room);
+        if(it != _rooms.end()) {
+            return &it->second;
+        }
+        return nullptr;
+    }
+
+    void join(const uint32_t room, const ConnectionHandle& handle);
+
+    void leave(const uint32_t room, const ConnectionHandle& handle);
+
+    void clear();
+
+private:
+    std::unordered_map<uint32_t, Subscribers> _rooms;
+};
+
+// ---------------------------------------------------------------------------
+// TimerWheel
+// ---------------------------------------------------------------------------
+
+class TimerWheel
+{
+public:
+    static constexpr uint32_t NONE       = UINT32_MAX;
+    static constexpr unsigned LEVELS     = 4;
+    static constexpr unsigned LEVEL_BITS = 6;
+    static constexpr unsigned SLOTS      = 1U << LEVEL_BITS;
+
+    TimerWheel(const uint64_t tick, const uint64_t now);
+
+    TimerWheel(const TimerWheel&) = delete;
+
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    virtual ~TimerWheel() = default;
+
+    bool empty() const
+    {
+        return _active == 0;
+    }
+
+    size_t size() const
+    {
+        return _active;
+    }
+
+    uint32_t arm(const uint64_t deadline, const uint64_t data);
+
+    void rearm(const uint32_t timer, const uint64_t deadline);
+
+    void cancel(const uint32_t timer);
+
+    int timeout(const uint64_t now) const;
+
+    void expire(const uint64_t now, std::vector<uint64_t>& expired);
+
+private:
+    struct Node
+    {
+        uint64_t expiry;
+        uint64_t data;
+        uint32_t prev;
+        uint32_t next;
+        uint16_t slot;
+        bool     armed;
+    };
+
+    void link(const uint32_t timer);
+
+    void unlink(const uint32_t timer);
+
+    void cascade(const unsigned level);
+
+private:
+    const uint64_t        _tick;
+    uint64_t              _current;
+    size_t                _active;
+    std::vector<Node>     _nodes;
+    std::vector<uint32_t> _free;
+    std::vector<uint32_t> _heads;
+    uint64_t              _occupied[LEVELS];
+};
+
+// ---------------------------------------------------------------------------
+// Histogram
+// ---------------------------------------------------------------------------
+
+class Histogram
+{
+public:
+    static constexpr unsigned SUB_BITS = 4;
+    static constexpr unsigned BUCKETS  = (64 - SUB_BITS + 1) << SUB_BITS;
+
+    Histogram();
+
+    Histogram(const Histogram&) = delete;
+
+    Histogram& operator=(const Histogram&) = delete;
+
+    virtual ~Histogram() = default;
+
+    void record(const uint64_t value);
+
+    void merge(const Histogram& other);
+
+    uint64_t count() const
+    {
+        return _count.load(std::memory_order_relaxed);
+    }
+
+    uint64_t sum() const
+    {
+        return _sum.load(std::memory_order_relaxed);
+    }
+
+    uint64_t percentile(const double quantile) const;
+
+    static unsigned bucket(const uint64_t value);
+
+    static uint64_t highest(const unsigned bucket);
+
+private:
+    std::array<std::atomic<uint64_t>, BUCKETS> _buckets;
+    std::atomic<uint64_t>                      _count;
+    std::atomic<uint64_t>                      _sum;
+};
+
+// ---------------------------------------------------------------------------
+// Metrics
+// ---------------------------------------------------------------------------
+
+class Metrics
+{
+public:
+    enum Counter : unsigned
+    {
+        ACCEPTS,
+        DISCONNECTS,
+        BYTES_IN,
+        BYTES_OUT,
+        MESSAGES_IN,
+        MESSAGES_OUT,
+        SEND_CALLS,
+        QUEUE_DROPS,
+        REJECTS,
+        THROTTLES,
+        PINGS,
+        PONGS,
+        COUNTERS,
+    };
+
+    Metrics();
+
+    Metrics(const Metrics&) = delete;
+
+    Metrics& operator=(const Metrics&) = delete;
+
+    virtual ~Metrics() = default;
+
+    void add(const Counter counter, const uint64_t value)
+    {
+        /* a single thread updates its own counters, readers only need a consistent word */
+        std::atomic<uint64_t>& slot(_counters[counter].value);
+        slot.store(slot.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    uint64_t get(const Counter counter) const
+    {
+        return _counters[counter].value.load(std::memory_order_relaxed);
+    }
+
+    Histogram& latency()
+    {
+        return _latency;
+    }
+
+    const Histogram& latency() const
+    {
+        return _latency;
+    }
+
+    Histogram& rtt()
+    {
+        return _rtt;
+    }
+
+    const Histogram& rtt() const
+    {
+        return _rtt;
+    }
+
+    static const char* name(const Counter counter);
+
+    static uint64_t now();
+
+private:
+    struct Slot
+    {
+        std::atomic<uint64_t> value;
+        char                  padding[64 - sizeof(std::atomic<uint64_t>)];
+    };
+
+    std::array<Slot, COUNTERS> _counters;
+    Histogram                  _latency;
+    Histogram                  _rtt;
+};
+
+// ---------------------------------------------------------------------------
+// EventListener
+// ---------------------------------------------------------------------------
+
+class EventListener
+{
+public:
+    EventListener() = default;
+
+    virtual ~EventListener() = default;
+
+    virtual void onReadable(const int fd);
+
+    virtual void onWritable(const int fd);
+
+    virtual void onAccepted(const int fd, const int client_fd);
+
+    virtual void onReceived(const int fd, const char* data, const size_t size);
+
+    virtual void onSent(const int fd, const ssize_t result);
+};
+
+// ---------------------------------------------------------------------------
+// EventLoop
+// ---------------------------------------------------------------------------
+
+class EventLoop
+{
+public:
+    enum Events : unsigned
+    {
+        EV_READ  = 0x01,
+        EV_WRITE = 0x02,
+        EV_EDGE  = 0x04,
+    };
+
+    EventLoop(EventListener& listener);
+
+    EventLoop(const EventLoop&) = delete;
+
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    virtual ~EventLoop() = default;
+
+    virtual const char* name() const = 0;
+
+    void add(const int fd, const unsigned events)
+    {
+        add(fd, events, _listener);
+    }
+
+    void add(const int fd, const unsigned events, EventListener& listener);
+
+    void modify(const int fd, const unsigned events);
+
+    void remove(const int fd);
+
+    void accept(const int fd);
+
+    void receive(const int fd);
+
+    virtual bool completions() const;
+
+    virtual size_t send(const int fd, const MessageQueue& queue, const size_t limit);
+
+    virtual int wait(const int timeout) = 0;
+
+    static auto create(const std::string& backend, EventListener& listener) -> std::unique_ptr<EventLoop>;
+
+protected:
+    virtual void doAdd(const int fd, const unsigned events) = 0;
+
+    virtual void doModify(const int fd, const unsigned events) = 0;
+
+    virtual void doRemove(const int fd) = 0;
+
+    virtual void doAccept(const int fd);
+
+    virtual void doReceive(const int fd);
+
+    void attach(const int fd, EventListener& listener);
+
+    void notifyReadable(const int fd);
+
+    void notifyWritable(const int fd);
+
+    void notifyAccepted(const int fd, const int client_fd);
+
+    void notifyReceived(const int fd, const char* data, const size_t size);
+
+    void notifySent(const int fd, const ssize_t result);
+
+protected:
+    EventListener&              _listener;
+    std::vector<EventListener*> _listeners;
+};
+
+// ---------------------------------------------------------------------------
+// PollEventLoop
+// ---------------------------------------------------------------------------
+
+class PollEventLoop final
+    : public EventLoop
+{
+public:
+    PollEventLoop(EventListener& listener);
+
+    virtual ~PollEventLoop() = default;
+
+    virtual const char* name() const override;
+
+    virtual int wait(const int timeout) override;
+
+protected:
+    virtual void doAdd(const int fd, const unsigned events) override;
+
+    virtual void doModify(const int fd, const unsigned events) override;
+
+    virtual void doRemove(const int fd) override;
+
+private:
+    std::vector<pollfd> _pollfds;
+    std::vector<pollfd> _ready;
+};
+
+// ---------------------------------------------------------------------------
+// EpollEventLoop
+// ---------------------------------------------------------------------------
+
+class EpollEventLoop final
+    : public EventLoop
+{
+public:
+    EpollEventLoop(EventListener& listener);
+
+    virtual ~EpollEventLoop();
+
+    virtual const char* name() const override;
+
+    virtual int wait(const int timeout) override;
+
+protected:
+    virtual void doAdd(const int fd, const unsigned events) override;
+
+    virtual void doModify(const int fd, const unsigned events) override;
+
+    virtual void doRemove(const int fd) override;
+
+private:
+    int                           _epfd;
+    std::array<epoll_event, 256> _events;
+};
+
+// ---------------------------------------------------------------------------
+// UringEventLoop
+// ---------------------------------------------------------------------------
+
+#ifdef HAVE_IO_URING
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+class UringEventLoop final
+    : public EventLoop
+{
+public:
+    UringEventLoop(EventListener& listener);
+
+    virtual ~UringEventLoop();
+
+    virtual const char* name() const override;
+
+    virtual bool completions() const override;
+
+    virtual size_t send(const int fd, const MessageQueue& queue, const size_t limit) override;
+
+    virtual int wait(const int timeout) override;
+
+protected:
+    virtual void doAdd(const int fd, const unsigned events) override;
+
+    virtual void doModify(const int fd, const unsigned events) override;
+
+    virtual void doRemove(const int fd) override;
+
+    virtual void doAccept(const int fd) override;
+
+    virtual void doReceive(const int fd) override;
+
+private:
+    enum Kind : uint64_t
+    {
+        KIND_NONE   = 0,
+        KIND_POLL   = 1,
+        KIND_ACCEPT = 2,
+        KIND_RECV   = 3,
+        KIND_SEND   = 4,
+        KIND_CANCEL = 5,
+        KIND_BUFFER = 6,
+        KIND_WRITE  = 7,
+        KIND_RETRY  = 8,
+    };
+
+    struct Slot
+    {
+        uint32_t generation;
+        Kind     kind;
+        unsigned events;
+        int32_t  request;
+        bool     receiving;
+        bool     paused;
+    };
+
+    struct SendRequest
+    {
+        int                     fd;
+        uint32_t                generation;
+        msghdr                  message;
+        std::vector<iovec>      iovecs;
+        std::vector<MessagePtr> pinned;
+    };
+
+    void release();
+
+    void probe();
+
+    bool await(const uint64_t user_data, io_uring_cqe& result);
+
+    auto slot(const int fd) -> Slot&;
+
+    bool current(const int fd, const uint32_t generation) const;
+
+    auto acquire() -> io_uring_sqe*;
+
+    int enter(const unsigned min_complete, const int timeout);
+
+    void arm(const int fd);
+
+    void cancel(const uint64_t user_data);
+
+    void retry(const int fd, const bool soon);
+
+    void complete(const io_uring_cqe& cqe);
+
+    void recycle(const unsigned bid);
+
+private:
+    int                                       _ring_fd;
+    void*                                     _ring_ptr;
+    size_t                                    _ring_size;
+    io_uring_sqe*                             _sqes;
+    size_t                                    _sqes_size;
+    unsigned*                                 _sq_head;
+    unsigned*                                 _sq_tail;
+    unsigned                                  _sq_mask;
+    unsigned                                  _sq_entries;
+    unsigned                                  _sq_local_tail;
+    unsigned                                  _to_submit;
+    unsigned*                                 _cq_head;
+    unsigned*                                 _cq_tail;
+    unsigned                                  _cq_mask;
+    io_uring_cqe*                             _cqes;
+    char*                                     _buffers;
+    std::vector<Slot>                         _slots;
+    std::vector<std::unique_ptr<SendRequest>> _requests;
+    std::vector<uint32_t>                     _free_requests;
+};
+
+#endif
+
+// ---------------------------------------------------------------------------
+// ChatConfig
+// ---------------------------------------------------------------------------
+
+struct ChatConfig
+{
+    enum QueuePolicy
+    {
+        DROP_OLDEST,
+        DISCONNECT,
+    };
+
+    std::string   backend           = "epoll";
+    unsigned      threads           = 1;
+    size_t        queue_limit       = 1048576;
+    QueuePolicy   queue_policy      = DROP_OLDEST;
+    size_t        max_line          = 4096;
+    std::string   history           = "";
+    size_t        history_segment   = 16777216;
+    size_t        history_segments  = 4;
+    std::string   transcript        = "";
+    size_t        recent            = 20;
+    uint16_t      metrics           = 0;
+    std::string   log               = "";
+    Logger::Level log_level         = Logger::INFO;
+    unsigned      idle_timeout      = 0;
+    unsigned      handshake_timeout = 0;
+    unsigned      write_timeout     = 60;
+    unsigned      ping_interval     = 0;
+    unsigned      ping_misses       = 3;
+    unsigned      rtt_limit         = 0;
+    unsigned      drain_timeout     = 10;
+    int           backlog           = 1024;
+    double        accept_rate       = 0.0;
+    double        accept_burst      = 0.0;
+    double        message_rate      = 0.0;
+    double        message_burst     = 0.0;
+    double        byte_rate         = 0.0;
+    double        byte_burst        = 0.0;
+    std::string   handoff           = "";
+};
+
+// ---------------------------------------------------------------------------
+// ChatWorker
+// ---------------------------------------------------------------------------
+
+class ChatServer;
+
+class ChatWorker final
+    : protected EventListener
+{
+public:
+    ChatWorker(ChatServer& server, const ChatConfig& config, const unsigned index);
+
+    ChatWorker(const ChatWorker&) = delete;
+
+    ChatWorker& operator=(const ChatWorker&) = delete;
+
+    virtual ~ChatWorker();
+
+    unsigned index() const
+    {
+        return _index;
+    }
+
+    EventLoop& loop()
+    {
+        return *_event_loop;
+    }
+
+    int listener() const
+    {
+        return _listener.fd();
+    }
+
+    void listen(const uint32_t addr, const uint16_t port, const bool reuseport);
+
+    void adopt(const int fd);
+
+    void start();
+
+    void run();
+
+    void join();
+
+    void stop();
+
+    void drain();
+
+    void post(const MessagePtr& msg, const uint32_t room);
+
+    void post(const MessagePtr& msg, const ConnectionHandle& target);
+
+    void deliver(const MessagePtr& msg, const uint32_t room, const int sender);
+
+    void deliver(const MessagePtr& msg, const ConnectionHandle& target);
+
+    void dump(std::ostream& stream) const;
+
+    const Metrics& metrics() const
+    {
+        return _metrics;
+    }
+
+protected:
+    virtual void onReadable(const int fd) override;
+
+    virtual void onWritable(const int fd) override;
+
+    virtual void onAccepted(const int fd, const int client_fd) override;
+
+    virtual void onReceived(const int fd, const char* data, const size_t size) override;
+
+    virtual void onSent(const int fd, const ssize_t result) override;
+
+private:
+    struct Delivery
+    {
+        MessagePtr       msg;
+        uint32_t         room;
+        ConnectionHandle target;
+    };
+
+    void enqueue(const Delivery& delivery);
+
+    void wakeup();
+
+    void drainInbox();
+
+    void watchListener();
+
+    void acceptClients();
+
+    bool admitClient(const int client_fd, const EndPoint& peer);
+
+    bool shedClient();
+
+    void registerClient(const int client_fd);
+
+    void readClient(const int fd);
+
+    bool parseClient(Connection& client);
+
+    void readBacklog();
+
+    void handleLine(Connection& client, const char* line, const size_t length);
+
+    void handleCommand(Connection& client, const char* line, const size_t length);
+
+    void handleRoomLine(Connection& client, const char* line, const size_t length);
+
+    uint32_t lookupRoom(const char* name, const size_t length, const bool create);
+
+    void reply(Connection& client, const std::string& text);
+
+    void closeClient(Connection& client);
+
+    void reapClients();
+
+    void drainClients();
+
+    void shutdown();
+
+    bool sendMsgToClient(Connection& client, const MessagePtr& msg);
+
+    void flushPending();
+
+    bool flushClient(Connection& client);
+
+    bool flushCatchup(Connection& client);
+
+    void recordSent(Connection& client, size_t sent);
+
+    void armTimer(Connection& client, const unsigned kind, const uint64_t deadline);
+
+    void expireTimers();
+
+    uint64_t readDeadline(Connection& client) const;
+
+    void sendPing(Connection& client);
+
+    void handlePong(Connection& client, const std::string& argument);
+
+    size_t queueLimit(const Connection& client) const;
+
+    unsigned clientEvents(const Connection& client, const bool writable) const;
+
+    void chargeClient(Connection& client, const double messages, const double bytes);
+
+    void refillClient(Connection& client);
+
+    uint64_t throttleDelay(const Connection& client) const;
+
+    void resumeClient(Connection& client);
+
+private:
+    enum TimerKind
+    {
+        TIMER_READ   = 0,
+        TIMER_WRITE  = 1,
+        TIMER_PING   = 2,
+        TIMER_RESUME = 3,
+    };
+
+    ChatServer&                               _server;
+    const ChatConfig&                         _config;
+    const unsigned                            _index;
+    std::unique_ptr<EventLoop>                _event_loop;
+    Socket                                    _listener;
+    ConnectionTable                           _clients;
+    RoomTable                                 _rooms;
+    std::unordered_map<std::string, uint32_t> _room_ids;
+    std::string                               _room_key;
+    std::vector<ConnectionHandle>             _pending;
+    std::vector<ConnectionHandle>             _backlog;
+    std::vector<ConnectionHandle>             _closing;
+    std::vector<iovec>                        _iovecs;
+    std::vector<MessagePtr>                   _recent;
+    Metrics                                   _metrics;
+    uint64_t                                  _received_at;
+    TimerWheel                                _timers;
+    std::vector<uint64_t>                     _expired;
+    uint64_t                                  _now;
+    uint64_t                                  _drain_deadline;
+    uint64_t                                  _accept_retry;
+    int                                       _wakeup_fd;
+    int                                       _reserve_fd;
+    std::mutex                                _mutex;
+    std::vector<Delivery>                     _inbox;
+    std::vector<Delivery>                     _inbox_spare;
+    std::atomic<bool>                         _quit;
+    std::atomic<bool>                         _draining;
+    std::thread                               _thread;
+};
+
+// ---------------------------------------------------------------------------
+// ChatServer
+// ---------------------------------------------------------------------------
+
+class ChatServer final
+    : protected SignalListener
+    , protected EventListener
+{
+public:
+    ChatServer(const ChatConfig& config);
+
+    virtual ~ChatServer();
+
+    void run(const uint32_t addr, const uint16_t port);
+
+    void broadcast(ChatWorker& origin, const int sender, const MessagePtr& msg, const uint32_t room);
+
+    uint32_t room(const std::string& name, const bool create);
+
+    bool registerNick(const std::string& nick, ChatWorker& worker, const ConnectionHandle& handle);
+
+    void releaseNick(const std::string& nick, ChatWorker& worker, const ConnectionHandle& handle);
+
+    bool sendPrivate(ChatWorker& origin, const std::string& nick, const MessagePtr& msg);
+
+    bool history(const size_t count, std::vector<MessagePtr>& result);
+
+    Transcript* transcript();
+
+    void recent(std::vector<MessagePtr>& result);
+
+    bool admit(const uint32_t addr);
+
+    bool admitting() const
+    {
+        return static_cast<bool>(_admission);
+    }
+
+    void drain();
+
+    void quit();
+
+protected:
+    virtual void onSigHgup() override;
+
+    virtual void onSigIntr() override;
+
+    virtual void onSigTerm() override;
+
+    virtual void onSigPipe() override;
+
+    virtual void onSigChld() override;
+
+    virtual void onSigAlrm() override;
+
+    virtual void onSigUsr1() override;
+
+    virtual void onSigUsr2() override;
+
+    virtual void onReadable(const int fd) override;
+
+private:
+    struct NickOwner
+    {
+        ChatWorker*      worker;
+        ConnectionHandle handle;
+    };
+
+    void cont();
+
+    void readStdin();
+
+    void handleCommand(const char* line, const size_t length);
+
+    void serveMetrics();
+
+    void exportMetrics(std::string& result);
+
+    void offerHandoff();
+
+    void handOff();
+
+    void closeHandoff(const bool unlink);
+
+private:
+    const ChatConfig                           _config;
+    std::vector<int>                           _inherited;
+    SignalManager                              _signal_manager;
+    LineFramer                                 _console;
+    std::unique_ptr<MessageLog>                _history;
+    std::unique_ptr<Transcript>                _transcript;
+    MessageRing                                _recent;
+    std::unique_ptr<AdmissionFilter>           _admission;
+    std::vector<std::unique_ptr<ChatWorker>>   _workers;
+    std::mutex                                 _rooms_mutex;
+    std::unordered_map<std::string, uint32_t>  _room_ids;
+    std::mutex                                 _nicks_mutex;
+    std::unordered_map<std::string, NickOwner> _nicks;
+    Socket                                     _metrics;
+    std::thread                                _metrics_thread;
+    Socket                                     _handoff;
+    std::atomic<bool>                          _handed_off;
+    std::atomic<bool>                          _draining;
+    std::atomic<bool>                          _quit;
 };
 
 // ---------------------------------------------------------------------------
@@ -0,0 +1,173 @@
+/*
+ * main.cc - Copyright (c) 2020 - Olivier Poncet
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <climits>
+#include <csignal>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <array>
+#include <string>
+#include <memory>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <iostream>
+#include <stdexcept>
+#include "chat.h"
+
+// ---------------------------------------------------------------------------
+// main
+// ---------------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+    const uint32_t addr = INADDR_ANY;
+    const uint16_t port = 1976;
+
+    try {
+        ChatConfig config;
+        for(int argi = 1; argi < argc; ++argi) {
+            const std::string arg(argv[argi]);
+            if(arg.compare(0, 10, "--backend=") == 0) {
+                config.backend = arg.substr(10);
+            }
+            else if(arg.compare(0, 10, "--threads=") == 0) {
+                config.threads = std::stoul(arg.substr(10));
+                if(config.threads == 0) {
+                    config.threads = std::thread::hardware_concurrency();
+                }
+            }
+            else if(arg.compare(0, 14, "--queue-limit=") == 0) {
+                config.queue_limit = std::stoul(arg.substr(14));
+            }
+            else if(arg == "--queue-policy=drop-oldest") {
+                config.queue_policy = ChatConfig::DROP_OLDEST;
+            }
+            else if(arg == "--queue-policy=disconnect") {
+                config.queue_policy = ChatConfig::DISCONNECT;
+            }
+            else if(arg.compare(0, 11, "--max-line=") == 0) {
+                config.max_line = std::stoul(arg.substr(11));
+            }
+            else if(arg.compare(0, 10, "--history=") == 0) {
+                config.history = arg.substr(10);
+            }
+            else if(arg.compare(0, 18, "--history-segment=") == 0) {
+                config.history_segment = std::stoul(arg.substr(18));
+            }
+            else if(arg.compare(0, 19, "--history-segments=") == 0) {
+                config.history_segments = std::stoul(arg.substr(19));
+            }
+            else if(arg.compare(0, 6, "--log=") == 0) {
+                config.log = arg.substr(6);
+            }
+            else if(arg.compare(0, 12, "--log-level=") == 0) {
+                config.log_level = Logger::level(arg.substr(12));
+            }
+            else if(arg.compare(0, 15, "--idle-timeout=") == 0) {
+                config.idle_timeout = std::stoul(arg.substr(15));
+            }
+            else if(arg.compare(0, 20, "--handshake-timeout=") == 0) {
+                config.handshake_timeout = std::stoul(arg.substr(20));
+            }
+            else if(arg.compare(0, 16, "--write-timeout=") == 0) {
+                config.write_timeout = std::stoul(arg.substr(16));
+            }
+            else if(arg.compare(0, 16, "--ping-interval=") == 0) {
+                config.ping_interval = std::stoul(arg.substr(16));
+            }
+            else if(arg.compare(0, 14, "--ping-misses=") == 0) {
+                config.ping_misses = std::stoul(arg.substr(14));
+            }
+            else if(arg.compare(0, 12, "--rtt-limit=") == 0) {
+                config.rtt_limit = std::stoul(arg.substr(12));
+            }
+            else if(arg.compare(0, 16, "--drain-timeout=") == 0) {
+                config.drain_timeout = std::stoul(arg.substr(16));
+            }
+            else if(arg.compare(0, 10, "--handoff=") == 0) {
+                config.handoff = arg.substr(10);
+            }
+            else if(arg.compare(0, 10, "--backlog=") == 0) {
+                config.backlog = std::stoi(arg.substr(10));
+            }
+            else if(arg.compare(0, 14, "--accept-rate=") == 0) {
+                config.accept_rate = std::stod(arg.substr(14));
+            }
+            else if(arg.compare(0, 15, "--accept-burst=") == 0) {
+                config.accept_burst = std::stod(arg.substr(15));
+            }
+            else if(arg.compare(0, 15, "--message-rate=") == 0) {
+                config.message_rate = std::stod(arg.substr(15));
+            }
+            else if(arg.compare(0, 16, "--message-burst=") == 0) {
+                config.message_burst = std::stod(arg.substr(16));
+            }
+            else if(arg.compare(0, 12, "--byte-rate=") == 0) {
+                config.byte_rate = std::stod(arg.substr(12));
+            }
+            else if(arg.compare(0, 13, "--byte-burst=") == 0) {
+                config.byte_burst = std::stod(arg.substr(13));
+            }
+            else if(arg.compare(0, 10, "--metrics=") == 0) {
+                config.metrics = std::stoul(arg.substr(10));
+            }
+            else if(arg.compare(0, 9, "--recent=") == 0) {
+                config.recent = std::stoul(arg.substr(9));
+            }
+            else if(arg.compare(0, 13, "--transcript=") == 0) {
+                config.transcript = arg.substr(13);
+            }
+            else {
+                throw std::runtime_error("invalid argument <" + arg + ">");
+            }
+        }
+        ChatServer chat_server(config);
+
+        chat_server.run(addr, port);
+    }
+    catch(const std::exception& e) {
+        const char* what(e.what());
+        std::cerr << "error: " << what << std::endl;
+        return EXIT_FAILURE;
+    }
+    catch(...) {
+        const char* what("unhandled exception");
+        std::cerr << "error: " << what << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// ---------------------------------------------------------------------------
+// End-Of-File
+// ---------------------------------------------------------------------------
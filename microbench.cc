@@ -0,0 +1,547 @@
+/*
+ * microbench.cc - Copyright (c) 2020 - Olivier Poncet
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <climits>
+#include <csignal>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <array>
+#include <string>
+#include <memory>
+#include <new>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <iostream>
+#include <iomanip>
+#include <stdexcept>
+#include <chrono>
+#include <random>
+#include <functional>
+#include <algorithm>
+#include "chat.h"
+
+// ---------------------------------------------------------------------------
+// Traffic
+// ---------------------------------------------------------------------------
+
+namespace {
+
+struct Traffic
+{
+    const char*       name;
+    std::vector<char> data;
+};
+
+Traffic make_lines(const char* name, const size_t size, const size_t min_line, const size_t max_line)
+{
+    /* printable text split into lines of pseudo-random lengths, as read from a socket */
+    std::mt19937 generator(1976);
+    std::uniform_int_distribution<size_t> line_length(min_line, max_line);
+    std::uniform_int_distribution<int>    character(' ', '~');
+
+    Traffic traffic{name, std::vector<char>()};
+    traffic.data.reserve(size);
+    while(traffic.data.size() < size) {
+        const size_t length = line_length(generator);
+        for(size_t index = 0; (index < length) && (traffic.data.size() < size - 1); ++index) {
+            traffic.data.push_back(static_cast<char>(character(generator)));
+        }
+        traffic.data.push_back('\n');
+    }
+    return traffic;
+}
+
+}
+
+// ---------------------------------------------------------------------------
+// Benchmark
+// ---------------------------------------------------------------------------
+
+namespace {
+
+volatile size_t sink = 0;
+
+bool        csv_output = false;
+bool        check_mode = false;
+std::string name_filter;
+
+class Benchmark
+{
+public:
+    Benchmark(const std::string& name, const size_t bytes)
+        : _name(name)
+        , _bytes(bytes)
+    {
+    }
+
+    void run(const std::function<size_t()>& function)
+    {
+        using clock = std::chrono::steady_clock;
+
+        if(_name.compare(0, name_filter.size(), name_filter) != 0) {
+            return;
+        }
+        const auto budget = std::chrono::milliseconds(200);
+        size_t     result = function();
+        uint64_t   count  = 0;
+        const auto start  = clock::now();
+        auto       stop   = start;
+        do {
+            for(int repeat = 0; repeat < 64; ++repeat) {
+                result += function();
+            }
+            count += 64;
+            stop = clock::now();
+        } while((stop - start) < budget);
+
+        const double elapsed = std::chrono::duration<double, std::nano>(stop - start).count();
+        const double per_op  = elapsed / count;
+        const double rate    = (_bytes * 1000.0) / per_op;
+
+        /* one comma-separated row per benchmark, for scripts comparing runs */
+        if(csv_output) {
+            std::cout << _name
+                      << std::fixed
+                      << ',' << std::setprecision(1) << per_op
+                      << ',' << std::setprecision(1) << rate
+                      << ',' << count
+                      << std::endl;
+            sink = result;
+            return;
+        }
+        std::cout.width(32);
+        std::cout << std::left << _name
+                  << std::right << std::fixed
+                  << ' ' << std::setw(12) << std::setprecision(1) << per_op << " ns/op";
+        if(_bytes != 0) {
+            std::cout << ' ' << std::setw(10) << std::setprecision(1) << rate << " MB/s";
+        }
+        std::cout << std::endl;
+        sink = result;
+    }
+
+private:
+    const std::string _name;
+    const size_t      _bytes;
+};
+
+}
+
+// ---------------------------------------------------------------------------
+// LineScanner benchmarks
+// ---------------------------------------------------------------------------
+
+namespace {
+
+size_t split_lines(LineScanner::Function function, const Traffic& traffic)
+{
+    const char* data  = traffic.data.data();
+    const char* end   = data + traffic.data.size();
+    size_t      lines = 0;
+
+    while(const char* eol = function(data, end)) {
+        data = eol + 1;
+        ++lines;
+    }
+    return lines;
+}
+
+void bench_scanner(const Traffic& traffic)
+{
+    struct Candidate
+    {
+        const char*           name;
+        LineScanner::Function function;
+        bool                  available;
+    };
+
+    const Candidate candidates[] = {
+        { "naive"   , &LineScanner::find_naive  , true                    },
+        { "memchr"  , &LineScanner::find_memchr , true                    },
+        { "sse2"    , &LineScanner::find_sse2   , LineScanner::has_sse2() },
+        { "avx2"    , &LineScanner::find_avx2   , LineScanner::has_avx2() },
+        { "dispatch", &LineScanner::find        , true                    },
+    };
+
+    for(const auto& candidate : candidates) {
+        if(candidate.available) {
+            Benchmark benchmark(std::string("scan/") + traffic.name + '/' + candidate.name, traffic.data.size());
+            benchmark.run([&]() -> size_t { return split_lines(candidate.function, traffic); });
+        }
+    }
+}
+
+}
+
+// ---------------------------------------------------------------------------
+// Socket benchmarks
+// ---------------------------------------------------------------------------
+
+namespace {
+
+struct SocketPair
+{
+    SocketPair()
+        : first()
+        , second()
+    {
+        int fds[2] = {-1, -1};
+        if(::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+            throw std::runtime_error("socketpair() has failed");
+        }
+        first.reset(fds[0]);
+        second.reset(fds[1]);
+    }
+
+    Socket first;
+    Socket second;
+};
+
+void bench_socket()
+{
+    SocketPair pair;
+    const std::string message(63, 'x');
+    const std::string line(message + '\n');
+    std::string       received;
+
+    Benchmark send_recv("socket/send+recv/64", line.size());
+    send_recv.run([&]() -> size_t {
+        pair.first.send(line);
+        pair.second.recv(received);
+        return received.size();
+    });
+
+    /* the batched path of flushClient(), one sendmsg() for a whole queue */
+    std::vector<iovec> iovecs(32, iovec{const_cast<char*>(line.data()), line.size()});
+    std::vector<char>  buffer(iovecs.size() * line.size());
+    Benchmark sendmsg_recv("socket/sendmsg+recv/32x64", buffer.size());
+    sendmsg_recv.run([&]() -> size_t {
+        size_t sent = pair.first.send(iovecs.data(), iovecs.size());
+        size_t read = 0;
+        while(read < sent) {
+            const ssize_t rc = ::recv(pair.second.fd(), buffer.data() + read, buffer.size() - read, 0);
+            if(rc <= 0) {
+                throw std::runtime_error("recv() has failed");
+            }
+            read += rc;
+        }
+        return read;
+    });
+}
+
+}
+
+// ---------------------------------------------------------------------------
+// LineFramer benchmarks
+// ---------------------------------------------------------------------------
+
+namespace {
+
+void bench_framer(const Traffic& traffic)
+{
+    /* the received bytes arrive in socket-sized chunks and are split in place */
+    LineFramer framer(8192);
+    Benchmark benchmark(std::string("frame/") + traffic.name, traffic.data.size());
+    benchmark.run([&]() -> size_t {
+        const char* data  = traffic.data.data();
+        size_t      left  = traffic.data.size();
+        size_t      lines = 0;
+        while(left > 0) {
+            const size_t chunk = std::min(left, static_cast<size_t>(1024));
+            framer.reserve(chunk);
+            ::memcpy(framer.tail(), data, chunk);
+            framer.commit(chunk);
+            data += chunk;
+            left -= chunk;
+            const char* line   = nullptr;
+            size_t      length = 0;
+            while(framer.next(line, length)) {
+                lines += length;
+            }
+        }
+        return lines;
+    });
+}
+
+}
+
+// ---------------------------------------------------------------------------
+// Fan-out benchmarks
+// ---------------------------------------------------------------------------
+
+namespace {
+
+void bench_fanout(const size_t sinks)
+{
+    /* one message is created and queued to every sink, which then gathers and consumes it */
+    std::vector<MessageQueue> queues(sinks);
+    const std::string         line(62, 'x');
+    iovec                     iov[8];
+    Benchmark benchmark("fanout/" + std::to_string(sinks), 0);
+    benchmark.run([&]() -> size_t {
+        const MessagePtr msg(Message::create_line(line.data(), line.size()));
+        size_t delivered = 0;
+        for(auto& queue : queues) {
+            queue.push_back(msg);
+        }
+        for(auto& queue : queues) {
+            const size_t count = queue.gather(iov, 8);
+            size_t bytes = 0;
+            for(size_t index = 0; index < count; ++index) {
+                bytes += iov[index].iov_len;
+            }
+            delivered += queue.consume(bytes);
+        }
+        return delivered;
+    });
+}
+
+}
+
+// ---------------------------------------------------------------------------
+// Table churn benchmarks
+// ---------------------------------------------------------------------------
+
+namespace {
+
+void bench_churn(const size_t count)
+{
+    /* connections come and go in an order unrelated to their arrival */
+    std::vector<std::unique_ptr<SocketPair>> pairs;
+    std::vector<int>                         fds;
+    for(size_t index = 0; index < count; ++index) {
+        pairs.emplace_back(new SocketPair());
+        fds.push_back(pairs.back()->first.fd());
+    }
+    std::vector<int> order(fds);
+    std::shuffle(order.begin(), order.end(), std::mt19937(1976));
+
+    ConnectionTable table;
+    Benchmark connections("churn/connections/" + std::to_string(count), 0);
+    connections.run([&]() -> size_t {
+        for(const int fd : fds) {
+            table.insert(fd, 4096);
+        }
+        const size_t size = table.size();
+        for(const int fd : order) {
+            /* the descriptor belongs to the socket pair, the connection must not close it */
+            table.find(fd)->socket().set_fd(-1);
+            table.erase(fd);
+        }
+        return size;
+    });
+
+    EventListener listener;
+    PollEventLoop loop(listener);
+    Benchmark pollfds("churn/pollfds/" + std::to_string(count), 0);
+    pollfds.run([&]() -> size_t {
+        for(const int fd : fds) {
+            loop.add(fd, EventLoop::EV_READ | EventLoop::EV_EDGE);
+        }
+        for(const int fd : order) {
+            loop.remove(fd);
+        }
+        return fds.size();
+    });
+}
+
+}
+
+// ---------------------------------------------------------------------------
+// Steady-state allocation check
+// ---------------------------------------------------------------------------
+
+namespace {
+
+std::atomic<uint64_t> check_operator_new(0);
+
+bool check_relay(const size_t sinks, const size_t warmup, const size_t messages)
+{
+    /* the relay path of a worker: recv into the framer, one message per line, fan-out and sendmsg() */
+    SocketPair                               sender;
+    std::vector<std::unique_ptr<SocketPair>> receivers;
+    std::vector<MessageQueue>                queues(sinks);
+    LineFramer                               framer(4096);
+    std::vector<char>                        drain(4096);
+    iovec                                    iov[8];
+    const std::string                        line(std::string(62, 'x') + '\n');
+    for(size_t sink = 0; sink < sinks; ++sink) {
+        receivers.emplace_back(new SocketPair());
+    }
+
+    auto relay = [&](const size_t count) -> size_t {
+        size_t delivered = 0;
+        for(size_t index = 0; index < count; ++index) {
+            sender.first.send(line.data(), line.size());
+            framer.reserve(4096);
+            const ssize_t rc = ::recv(sender.second.fd(), framer.tail(), framer.room(), 0);
+            if(rc <= 0) {
+                throw std::runtime_error("recv() has failed");
+            }
+            framer.commit(rc);
+            const char* data   = nullptr;
+            size_t      length = 0;
+            while(framer.next(data, length)) {
+                const MessagePtr msg(Message::create_line(data, length));
+                for(auto& queue : queues) {
+                    queue.push_back(msg);
+                }
+            }
+            for(size_t sink = 0; sink < sinks; ++sink) {
+                MessageQueue& queue(queues[sink]);
+                size_t        sent = 0;
+                while(!queue.empty()) {
+                    const size_t size = receivers[sink]->first.send(iov, queue.gather(iov, 8));
+                    delivered += queue.consume(size);
+                    sent      += size;
+                }
+                while(sent > 0) {
+                    const ssize_t rc = ::recv(receivers[sink]->second.fd(), drain.data(), std::min(sent, drain.size()), 0);
+                    if(rc <= 0) {
+                        throw std::runtime_error("recv() has failed");
+                    }
+                    sent -= rc;
+                }
+            }
+        }
+        return delivered;
+    };
+
+    /* the warm-up fills the pool caches and grows the rings to their working size */
+    relay(warmup);
+    const uint64_t pool_before = MemoryPool::heap_allocations();
+    const uint64_t new_before  = check_operator_new.load(std::memory_order_relaxed);
+    const size_t   delivered   = relay(messages);
+    const uint64_t pool_after  = MemoryPool::heap_allocations();
+    const uint64_t new_after   = check_operator_new.load(std::memory_order_relaxed);
+
+    const bool passed = (delivered == (messages * sinks))
+                     && (pool_after == pool_before)
+                     && (new_after  == new_before);
+    std::cout << "check : relayed " << messages << " messages to " << sinks << " sinks"
+              << ", " << delivered << " delivered"
+              << ", " << (pool_after - pool_before) << " pool heap allocations"
+              << ", " << (new_after - new_before) << " operator new calls"
+              << ", " << (passed ? "passed" : "FAILED")
+              << std::endl;
+    return passed;
+}
+
+}
+
+void* operator new(std::size_t size)
+{
+    /* counted so the check can tell a heap allocation that bypasses the pool */
+    check_operator_new.fetch_add(1, std::memory_order_relaxed);
+    if(void* block = std::malloc(size != 0 ? size : 1)) {
+        return block;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* block) noexcept
+{
+    std::free(block);
+}
+
+void operator delete(void* block, std::size_t) noexcept
+{
+    std::free(block);
+}
+
+// ---------------------------------------------------------------------------
+// main
+// ---------------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+    try {
+        for(int argi = 1; argi < argc; ++argi) {
+            const std::string arg(argv[argi]);
+            if(arg == "--csv") {
+                csv_output = true;
+            }
+            else if(arg.compare(0, 9, "--filter=") == 0) {
+                name_filter = arg.substr(9);
+            }
+            else if(arg == "--check") {
+                check_mode = true;
+            }
+            else {
+                throw std::runtime_error("invalid argument <" + arg + ">");
+            }
+        }
+        if(check_mode) {
+            return check_relay(100, 1000, 10000) ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        if(csv_output) {
+            std::cout << "benchmark,ns_per_op,mb_per_s,iterations" << std::endl;
+        }
+        else {
+            std::cout << "line scanner: " << LineScanner::name() << std::endl;
+        }
+
+        const Traffic traffics[] = {
+            make_lines("short"  , 4096,   8,   40),
+            make_lines("chat"   , 4096,  20,  160),
+            make_lines("long"   , 4096, 200, 1000),
+            make_lines("nolf"   , 4096, 4096, 4096),
+        };
+        for(const auto& traffic : traffics) {
+            bench_scanner(traffic);
+        }
+        for(const auto& traffic : traffics) {
+            bench_framer(traffic);
+        }
+        bench_socket();
+        for(const size_t sinks : {10, 100, 1000}) {
+            bench_fanout(sinks);
+        }
+        bench_churn(256);
+    }
+    catch(const std::exception& e) {
+        const char* what(e.what());
+        std::cerr << "error: " << what << std::endl;
+        return EXIT_FAILURE;
+    }
+    catch(...) {
+        const char* what("unhandled exception");
+        std::cerr << "error: " << what << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// ---------------------------------------------------------------------------
+// End-Of-File
+// ---------------------------------------------------------------------------